@@ -21,7 +21,7 @@
 u32 acpi_pm1a_cnt VARFSEG;
 
 static void
-build_header(struct acpi_table_header *h, u32 sig, int len, u8 rev)
+init_header(struct acpi_table_header *h, u32 sig, int len, u8 rev)
 {
     h->signature = cpu_to_le32(sig);
     h->length = cpu_to_le32(len);
@@ -32,6 +32,12 @@ build_header(struct acpi_table_header *h, u32 sig, int len, u8 rev)
     h->oem_revision = cpu_to_le32(1);
     memcpy(h->asl_compiler_id, BUILD_APPNAME4, 4);
     h->asl_compiler_revision = cpu_to_le32(1);
+}
+
+static void
+build_header(struct acpi_table_header *h, u32 sig, int len, u8 rev)
+{
+    init_header(h, sig, len, rev);
     h->checksum -= checksum(h, len);
 }
 
@@ -140,14 +146,36 @@ build_fadt(struct pci_device *pci)
     return fadt;
 }
 
+// APIC IDs below this use the legacy 8-bit xAPIC table entries.
+#define ACPI_X2APIC_ID_START 0xff
+// The x2APIC processor objects are named Cxxx.
+#define ACPI_MAX_CPUS 0x1000
+
+// Return the number of APIC IDs to describe in the ACPI tables.
+static int
+acpi_apic_id_count(void)
+{
+    int count = MaxCountCPUs;
+    if (count < MaxAPICID + 1)
+        count = MaxAPICID + 1;
+    if (count > ACPI_MAX_CPUS)
+        count = ACPI_MAX_CPUS;
+    return count;
+}
+
 static void*
 build_madt(void)
 {
+    int cpus = acpi_apic_id_count(), x2cpus = 0;
+    if (cpus > ACPI_X2APIC_ID_START)
+        x2cpus = cpus - ACPI_X2APIC_ID_START;
     int madt_size = (sizeof(struct multiple_apic_table)
-                     + sizeof(struct madt_processor_apic) * MaxCountCPUs
+                     + sizeof(struct madt_processor_apic) * (cpus - x2cpus)
+                     + sizeof(struct madt_local_x2apic) * x2cpus
                      + sizeof(struct madt_io_apic)
                      + sizeof(struct madt_intsrcovr) * 16
-                     + sizeof(struct madt_local_nmi));
+                     + sizeof(struct madt_local_nmi)
+                     + sizeof(struct madt_local_x2apic_nmi));
 
     struct multiple_apic_table *madt = malloc_high(madt_size);
     if (!madt) {
@@ -159,7 +187,7 @@ build_madt(void)
     madt->flags = cpu_to_le32(1);
     struct madt_processor_apic *apic = (void*)&madt[1];
     int i;
-    for (i=0; i<MaxCountCPUs; i++) {
+    for (i=0; i<cpus - x2cpus; i++) {
         apic->type = APIC_PROCESSOR;
         apic->length = sizeof(*apic);
         apic->processor_id = i;
@@ -170,7 +198,16 @@ build_madt(void)
             apic->flags = cpu_to_le32(0);
         apic++;
     }
-    struct madt_io_apic *io_apic = (void*)apic;
+    struct madt_local_x2apic *x2apic = (void*)apic;
+    for (; i<cpus; i++) {
+        x2apic->type = APIC_LOCAL_X2APIC;
+        x2apic->length = sizeof(*x2apic);
+        x2apic->x2apic_id = cpu_to_le32(i);
+        x2apic->uid = cpu_to_le32(i);
+        x2apic->flags = cpu_to_le32(apic_id_is_present(i) ? 1 : 0);
+        x2apic++;
+    }
+    struct madt_io_apic *io_apic = (void*)x2apic;
     io_apic->type = APIC_IO;
     io_apic->length = sizeof(*io_apic);
     io_apic->io_apic_id = BUILD_IOAPIC_ID;
@@ -208,10 +245,84 @@ build_madt(void)
     local_nmi->lint         = 1; /* LINT1 */
     local_nmi++;
 
-    build_header((void*)madt, APIC_SIGNATURE, (void*)local_nmi - (void*)madt, 1);
+    void *end = local_nmi;
+    if (x2cpus) {
+        struct madt_local_x2apic_nmi *x2apic_nmi = end;
+        x2apic_nmi->type    = APIC_LOCAL_X2APIC_NMI;
+        x2apic_nmi->length  = sizeof(*x2apic_nmi);
+        x2apic_nmi->uid     = cpu_to_le32(0xffffffff); /* all processors */
+        x2apic_nmi->flags   = cpu_to_le16(0);
+        x2apic_nmi->lint    = 1; /* LINT1 */
+        end = &x2apic_nmi[1];
+    }
+
+    build_header((void*)madt, APIC_SIGNATURE, end - (void*)madt, 1);
     return madt;
 }
 
+/****************************************************************
+ * Streaming AML builder
+ ****************************************************************/
+
+// State of a table being emitted into a preallocated buffer.  The sum
+// of all bytes emitted is kept so that the table does not need to be
+// scanned again to compute its checksum.
+struct aml_s {
+    u8 *start, *pos;
+    u8 sum;
+};
+
+static void
+aml_init(struct aml_s *a, u8 *buf)
+{
+    a->start = a->pos = buf;
+    a->sum = 0;
+}
+
+static inline int
+aml_offset(struct aml_s *a)
+{
+    return a->pos - a->start;
+}
+
+static inline void
+aml_byte(struct aml_s *a, u8 val)
+{
+    *(a->pos++) = val;
+    a->sum += val;
+}
+
+static void
+aml_mem(struct aml_s *a, const void *data, int len)
+{
+    memcpy(a->pos, data, len);
+    a->pos += len;
+    a->sum += checksum((void*)data, len);
+}
+
+static void
+aml_dword(struct aml_s *a, u32 val)
+{
+    u32 v = cpu_to_le32(val);
+    aml_mem(a, &v, sizeof(v));
+}
+
+// Reserve space for data that the caller fills in directly; the data
+// must be accounted for with aml_commit() once complete.
+static u8 *
+aml_reserve(struct aml_s *a, int len)
+{
+    u8 *p = a->pos;
+    a->pos += len;
+    return p;
+}
+
+static void
+aml_commit(struct aml_s *a, u8 *p, int len)
+{
+    a->sum += checksum(p, len);
+}
+
 // Encode a hex value
 static inline char getHex(u32 val) {
     val &= 0x0f;
@@ -219,21 +330,36 @@ static inline char getHex(u32 val) {
 }
 
 // Encode a length in an SSDT.
-static u8 *
-encodeLen(u8 *ssdt_ptr, int length, int bytes)
-{
-    switch (bytes) {
-    default:
-    case 4: ssdt_ptr[3] = ((length >> 20) & 0xff);
-    case 3: ssdt_ptr[2] = ((length >> 12) & 0xff);
-    case 2: ssdt_ptr[1] = ((length >> 4) & 0xff);
-            ssdt_ptr[0] = (((bytes-1) & 0x3) << 6) | (length & 0x0f);
-            break;
-    case 1: ssdt_ptr[0] = length & 0x3f;
+static void
+aml_pkglen(struct aml_s *a, int length, int bytes)
+{
+    if (bytes == 1) {
+        aml_byte(a, length & 0x3f);
+        return;
     }
-    return ssdt_ptr + bytes;
+    aml_byte(a, (((bytes-1) & 0x3) << 6) | (length & 0x0f));
+    int i;
+    for (i=1; i<bytes; i++)
+        aml_byte(a, (length >> (i*8 - 4)) & 0xff);
+}
+
+// Fill in the table header (which must have been emitted as the
+// first bytes of the table) and set the checksum.
+static void
+aml_finish(struct aml_s *a, u32 sig, u8 rev)
+{
+    struct acpi_table_header *h = (void*)a->start;
+    u8 sum = a->sum - checksum(h, sizeof(*h));
+    h->checksum = 0;
+    init_header(h, sig, aml_offset(a), rev);
+    h->checksum -= sum + checksum(h, sizeof(*h));
 }
 
+
+/****************************************************************
+ * SSDT
+ ****************************************************************/
+
 #include "ssdt-proc.hex"
 
 /* 0x5B 0x83 ProcessorOp PkgLength NameString ProcID */
@@ -260,34 +386,88 @@ encodeLen(u8 *ssdt_ptr, int length, int bytes)
 
 #define PCI_RMV_BASE 0xae0c
 
-static u8*
-build_notify(u8 *ssdt_ptr, const char *name, int skip, int count,
+static void
+build_notify(struct aml_s *a, const char *name, int skip, int count,
              const char *target, int ofs)
 {
     count -= skip;
 
-    *(ssdt_ptr++) = 0x14; // MethodOp
-    ssdt_ptr = encodeLen(ssdt_ptr, 2+5+(12*count), 2);
-    memcpy(ssdt_ptr, name, 4);
-    ssdt_ptr += 4;
-    *(ssdt_ptr++) = 0x02; // MethodOp
+    aml_byte(a, 0x14); // MethodOp
+    aml_pkglen(a, 2+5+(12*count), 2);
+    aml_mem(a, name, 4);
+    aml_byte(a, 0x02); // MethodOp
 
+    char targetname[4];
+    memcpy(targetname, target, 4);
     int i;
     for (i = skip; count-- > 0; i++) {
-        *(ssdt_ptr++) = 0xA0; // IfOp
-        ssdt_ptr = encodeLen(ssdt_ptr, 11, 1);
-        *(ssdt_ptr++) = 0x93; // LEqualOp
-        *(ssdt_ptr++) = 0x68; // Arg0Op
-        *(ssdt_ptr++) = 0x0A; // BytePrefix
-        *(ssdt_ptr++) = i;
-        *(ssdt_ptr++) = 0x86; // NotifyOp
-        memcpy(ssdt_ptr, target, 4);
-        ssdt_ptr[ofs] = getHex(i >> 4);
-        ssdt_ptr[ofs + 1] = getHex(i);
-        ssdt_ptr += 4;
-        *(ssdt_ptr++) = 0x69; // Arg1Op
+        aml_byte(a, 0xA0); // IfOp
+        aml_pkglen(a, 11, 1);
+        aml_byte(a, 0x93); // LEqualOp
+        aml_byte(a, 0x68); // Arg0Op
+        aml_byte(a, 0x0A); // BytePrefix
+        aml_byte(a, i);
+        aml_byte(a, 0x86); // NotifyOp
+        targetname[ofs] = getHex(i >> 4);
+        targetname[ofs + 1] = getHex(i);
+        aml_mem(a, targetname, 4);
+        aml_byte(a, 0x69); // Arg1Op
     }
-    return ssdt_ptr;
+}
+
+// Build the Processor object for each processor from the ssdt_proc
+// template.  Only the name and id bytes differ between processors,
+// so the checksum of the rest of the template is computed only once.
+static void
+build_procs(struct aml_s *a, int count)
+{
+    u8 *tmpl = PROC_AML;
+    u8 tmplsum = (checksum(tmpl, PROC_SIZEOF)
+                  - tmpl[PROC_OFFSET_CPUHEX] - tmpl[PROC_OFFSET_CPUHEX+1]
+                  - tmpl[PROC_OFFSET_CPUID1] - tmpl[PROC_OFFSET_CPUID2]);
+    int i;
+    for (i=0; i<count; i++) {
+        u8 *p = aml_reserve(a, PROC_SIZEOF);
+        memcpy(p, tmpl, PROC_SIZEOF);
+        p[PROC_OFFSET_CPUHEX] = getHex(i >> 4);
+        p[PROC_OFFSET_CPUHEX+1] = getHex(i);
+        p[PROC_OFFSET_CPUID1] = i;
+        p[PROC_OFFSET_CPUID2] = i;
+        a->sum += (tmplsum + p[PROC_OFFSET_CPUHEX] + p[PROC_OFFSET_CPUHEX+1]
+                   + p[PROC_OFFSET_CPUID1] + p[PROC_OFFSET_CPUID2]);
+    }
+}
+
+// Size of a Device() object built by build_x2apic_proc()
+#define X2APIC_PROC_SIZEOF (2+1+4+15+10+7)
+
+// build "Device(Cxxx) {Name(_HID, "ACPI0007") Name(_UID, id) Name(_STA, sta)}"
+// for processors with APIC IDs that do not fit a Processor() object.
+static void
+build_x2apic_proc(struct aml_s *a, u32 id)
+{
+    aml_byte(a, 0x5B); // ExtOpPrefix
+    aml_byte(a, 0x82); // DeviceOp
+    aml_pkglen(a, X2APIC_PROC_SIZEOF - 2, 1);
+    aml_byte(a, 'C');
+    aml_byte(a, getHex(id >> 8));
+    aml_byte(a, getHex(id >> 4));
+    aml_byte(a, getHex(id));
+
+    aml_byte(a, 0x08); // NameOp
+    aml_mem(a, "_HID", 4);
+    aml_byte(a, 0x0D); // StringPrefix
+    aml_mem(a, "ACPI0007", 9);
+
+    aml_byte(a, 0x08); // NameOp
+    aml_mem(a, "_UID", 4);
+    aml_byte(a, 0x0C); // DWordPrefix
+    aml_dword(a, id);
+
+    aml_byte(a, 0x08); // NameOp
+    aml_mem(a, "_STA", 4);
+    aml_byte(a, 0x0A); // BytePrefix
+    aml_byte(a, apic_id_is_present(id) ? 0x0F : 0x00);
 }
 
 static void patch_pcihp(int slot, u8 *ssdt_ptr, u32 eject)
@@ -311,10 +491,12 @@ static void patch_pcihp(int slot, u8 *ssdt_ptr, u32 eject)
 static void*
 build_ssdt(void)
 {
-    int acpi_cpus = MaxCountCPUs > 0xff ? 0xff : MaxCountCPUs;
+    int cpus = acpi_apic_id_count();
+    int acpi_cpus = cpus > ACPI_X2APIC_ID_START ? ACPI_X2APIC_ID_START : cpus;
     int length = (sizeof(ssdp_misc_aml)                     // _S3_ / _S4_ / _S5_
                   + (1+3+4)                                 // Scope(_SB_)
                   + (acpi_cpus * PROC_SIZEOF)               // procs
+                  + ((cpus - acpi_cpus) * X2APIC_PROC_SIZEOF) // x2apic procs
                   + (1+2+5+(12*acpi_cpus))                  // NTFY
                   + (6+2+1+(1*acpi_cpus))                   // CPON
                   + (1+3+4)                                 // Scope(PCI0)
@@ -325,7 +507,8 @@ build_ssdt(void)
         warn_noalloc();
         return NULL;
     }
-    u8 *ssdt_ptr = ssdt;
+    struct aml_s a;
+    aml_init(&a, ssdt);
 
     // Copy header and encode fwcfg values in the S3_ / S4_ / S5_ packages
     int sys_state_size;
@@ -333,6 +516,7 @@ build_ssdt(void)
     if (!sys_states || sys_state_size != 6)
         sys_states = (char[]){128, 0, 0, 129, 128, 128};
 
+    u8 *ssdt_ptr = aml_reserve(&a, sizeof(ssdp_misc_aml));
     memcpy(ssdt_ptr, ssdp_misc_aml, sizeof(ssdp_misc_aml));
     if (!(sys_states[3] & 128))
         ssdt_ptr[acpi_s3_name[0]] = 'X';
@@ -357,65 +541,57 @@ build_ssdt(void)
     int pvpanic_port = romfile_loadint("etc/pvpanic-port", 0x0);
     *(u16 *)(ssdt_ptr + *ssdt_isa_pest) = pvpanic_port;
 
-    ssdt_ptr += sizeof(ssdp_misc_aml);
+    aml_commit(&a, ssdt_ptr, sizeof(ssdp_misc_aml));
 
     // build Scope(_SB_) header
-    *(ssdt_ptr++) = 0x10; // ScopeOp
-    ssdt_ptr = encodeLen(ssdt_ptr, length - (ssdt_ptr - ssdt), 3);
-    *(ssdt_ptr++) = '_';
-    *(ssdt_ptr++) = 'S';
-    *(ssdt_ptr++) = 'B';
-    *(ssdt_ptr++) = '_';
+    aml_byte(&a, 0x10); // ScopeOp
+    aml_pkglen(&a, length - aml_offset(&a), 3);
+    aml_mem(&a, "_SB_", 4);
 
     // build Processor object for each processor
-    int i;
-    for (i=0; i<acpi_cpus; i++) {
-        memcpy(ssdt_ptr, PROC_AML, PROC_SIZEOF);
-        ssdt_ptr[PROC_OFFSET_CPUHEX] = getHex(i >> 4);
-        ssdt_ptr[PROC_OFFSET_CPUHEX+1] = getHex(i);
-        ssdt_ptr[PROC_OFFSET_CPUID1] = i;
-        ssdt_ptr[PROC_OFFSET_CPUID2] = i;
-        ssdt_ptr += PROC_SIZEOF;
-    }
+    build_procs(&a, acpi_cpus);
 
     // build "Method(NTFY, 2) {If (LEqual(Arg0, 0x00)) {Notify(CP00, Arg1)} ...}"
     // Arg0 = Processor ID = APIC ID
-    ssdt_ptr = build_notify(ssdt_ptr, "NTFY", 0, acpi_cpus, "CP00", 2);
+    build_notify(&a, "NTFY", 0, acpi_cpus, "CP00", 2);
 
     // build "Name(CPON, Package() { One, One, ..., Zero, Zero, ... })"
-    *(ssdt_ptr++) = 0x08; // NameOp
-    *(ssdt_ptr++) = 'C';
-    *(ssdt_ptr++) = 'P';
-    *(ssdt_ptr++) = 'O';
-    *(ssdt_ptr++) = 'N';
-    *(ssdt_ptr++) = 0x12; // PackageOp
-    ssdt_ptr = encodeLen(ssdt_ptr, 2+1+(1*acpi_cpus), 2);
-    *(ssdt_ptr++) = acpi_cpus;
+    aml_byte(&a, 0x08); // NameOp
+    aml_mem(&a, "CPON", 4);
+    aml_byte(&a, 0x12); // PackageOp
+    aml_pkglen(&a, 2+1+(1*acpi_cpus), 2);
+    aml_byte(&a, acpi_cpus);
+    int i;
     for (i=0; i<acpi_cpus; i++)
-        *(ssdt_ptr++) = (apic_id_is_present(i)) ? 0x01 : 0x00;
+        aml_byte(&a, (apic_id_is_present(i)) ? 0x01 : 0x00);
+
+    // build Device object for each processor with an x2APIC only ID
+    for (i=acpi_cpus; i<cpus; i++)
+        build_x2apic_proc(&a, i);
 
     // build Scope(PCI0) opcode
-    *(ssdt_ptr++) = 0x10; // ScopeOp
-    ssdt_ptr = encodeLen(ssdt_ptr, length - (ssdt_ptr - ssdt), 3);
-    *(ssdt_ptr++) = 'P';
-    *(ssdt_ptr++) = 'C';
-    *(ssdt_ptr++) = 'I';
-    *(ssdt_ptr++) = '0';
+    aml_byte(&a, 0x10); // ScopeOp
+    aml_pkglen(&a, length - aml_offset(&a), 3);
+    aml_mem(&a, "PCI0", 4);
 
     // build Device object for each slot
     u32 rmvc_pcrm = inl(PCI_RMV_BASE);
     for (i=1; i<PCI_SLOTS; i++) {
         u32 eject = rmvc_pcrm & (0x1 << i);
+        ssdt_ptr = aml_reserve(&a, PCIHP_SIZEOF);
         memcpy(ssdt_ptr, PCIHP_AML, PCIHP_SIZEOF);
         patch_pcihp(i, ssdt_ptr, eject != 0);
-        ssdt_ptr += PCIHP_SIZEOF;
+        aml_commit(&a, ssdt_ptr, PCIHP_SIZEOF);
     }
 
-    ssdt_ptr = build_notify(ssdt_ptr, "PCNT", 1, PCI_SLOTS, "S00_", 1);
+    build_notify(&a, "PCNT", 1, PCI_SLOTS, "S00_", 1);
 
-    build_header((void*)ssdt, SSDT_SIGNATURE, ssdt_ptr - ssdt, 1);
+    if (aml_offset(&a) != length)
+        warn_internalerror();
+    aml_finish(&a, SSDT_SIGNATURE, 1);
+    dprintf(3, "SSDT: %d bytes for %d cpus\n", aml_offset(&a), cpus);
 
-    //hexdump(ssdt, ssdt_ptr - ssdt);
+    //hexdump(ssdt, aml_offset(&a));
 
     return ssdt;
 }
@@ -475,10 +651,14 @@ build_srat(void)
         goto fail;
     int max_cpu = numacpusize / sizeof(u64);
     int nb_numa_nodes = numadatasize / sizeof(u64);
+    int x2cpus = 0;
+    if (max_cpu > ACPI_X2APIC_ID_START)
+        x2cpus = max_cpu - ACPI_X2APIC_ID_START;
 
     struct system_resource_affinity_table *srat;
     int srat_size = sizeof(*srat) +
-        sizeof(struct srat_processor_affinity) * max_cpu +
+        sizeof(struct srat_processor_affinity) * (max_cpu - x2cpus) +
+        sizeof(struct srat_x2apic_affinity) * x2cpus +
         sizeof(struct srat_memory_affinity) * (nb_numa_nodes + 2);
 
     srat = malloc_high(srat_size);
@@ -493,7 +673,7 @@ build_srat(void)
     int i;
     u64 curnode;
 
-    for (i = 0; i < max_cpu; ++i) {
+    for (i = 0; i < max_cpu - x2cpus; ++i) {
         core->type = SRAT_PROCESSOR;
         core->length = sizeof(*core);
         core->local_apic_id = i;
@@ -507,12 +687,21 @@ build_srat(void)
             core->flags = cpu_to_le32(0);
         core++;
     }
-
+    struct srat_x2apic_affinity *x2core = (void*)core;
+    for (; i < max_cpu; ++i) {
+        x2core->type = SRAT_LOCAL_X2APIC;
+        x2core->length = sizeof(*x2core);
+        x2core->x2apic_id = cpu_to_le32(i);
+        curnode = *numacpumap++;
+        x2core->proximity = cpu_to_le32(curnode);
+        x2core->flags = cpu_to_le32(apic_id_is_present(i) ? 1 : 0);
+        x2core++;
+    }
 
     /* the memory map is a bit tricky, it contains at least one hole
      * from 640k-1M and possibly another one from 3.5G-4G.
      */
-    struct srat_memory_affinity *numamem = (void*)core;
+    struct srat_memory_affinity *numamem = (void*)x2core;
     int slots = 0;
     u64 mem_len, mem_base, next_base = 0;
 
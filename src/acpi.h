@@ -167,7 +167,9 @@ struct multiple_apic_table
 #define APIC_IO_SAPIC           6
 #define APIC_LOCAL_SAPIC        7
 #define APIC_XRUPT_SOURCE       8
-#define APIC_RESERVED           9           /* 9 and greater are reserved */
+#define APIC_LOCAL_X2APIC       9
+#define APIC_LOCAL_X2APIC_NMI   10
+#define APIC_RESERVED           11          /* 11 and greater are reserved */
 
 /*
  * MADT sub-structures (Follow MULTIPLE_APIC_DESCRIPTION_TABLE)
@@ -211,6 +213,24 @@ struct madt_local_nmi {
     u8  lint;                   /* Local APIC LINT# */
 } PACKED;
 
+struct madt_local_x2apic
+{
+    ACPI_SUB_HEADER_DEF
+    u16 reserved;
+    u32 x2apic_id;              /* Processor's local x2APIC id */
+    u32 flags;
+    u32 uid;                    /* ACPI processor _UID */
+} PACKED;
+
+struct madt_local_x2apic_nmi
+{
+    ACPI_SUB_HEADER_DEF
+    u16 flags;                  /* MPS INTI flags */
+    u32 uid;                    /* ACPI processor _UID */
+    u8  lint;                   /* Local x2APIC LINT# */
+    u8  reserved[3];
+} PACKED;
+
 /*
  * HPET Description Table
  */
@@ -238,6 +258,7 @@ struct system_resource_affinity_table
 
 #define SRAT_PROCESSOR          0
 #define SRAT_MEMORY             1
+#define SRAT_LOCAL_X2APIC       2
 
 struct srat_processor_affinity
 {
@@ -262,6 +283,17 @@ struct srat_memory_affinity
     u32    reserved3[2];
 } PACKED;
 
+struct srat_x2apic_affinity
+{
+    ACPI_SUB_HEADER_DEF
+    u16    reserved1;
+    u32    proximity;
+    u32    x2apic_id;
+    u32    flags;
+    u32    clock_domain;
+    u32    reserved2;
+} PACKED;
+
 /* PCI fw r3.0 MCFG table. */
 /* Subtable */
 struct acpi_mcfg_allocation {
@@ -8,7 +8,7 @@
 #include "ioport.h" // inb
 #include "util.h" // dprintf
 #include "biosvar.h" // GET_GLOBAL
-#include "pci.h" // foreachpci
+#include "pci.h" // foreachpci_class
 #include "pci_ids.h" // PCI_CLASS_STORAGE_OTHER
 #include "pci_regs.h" // PCI_INTERRUPT_LINE
 #include "boot.h" // add_bcv_hd
@@ -627,11 +627,13 @@ ahci_scan(void)
 {
     // Scan PCI bus for ATA adapters
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_class(pci, PCI_CLASS_STORAGE_SATA) {
         if (pci->class != PCI_CLASS_STORAGE_SATA)
             continue;
         if (pci->prog_if != 1 /* AHCI rev 1 */)
             continue;
+        if (boot_skip_pci(pci))
+            continue;
         ahci_controller_setup(pci);
     }
 }
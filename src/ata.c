@@ -941,6 +941,8 @@ init_controller(struct pci_device *pci, int irq
 static void
 init_pciata(struct pci_device *pci, u8 prog_if)
 {
+    if (boot_skip_pci(pci))
+        return;
     pci->have_driver = 1;
     u16 bdf = pci->bdf;
     u8 pciirq = pci_config_readb(bdf, PCI_INTERRUPT_LINE);
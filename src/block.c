@@ -13,6 +13,7 @@
 #include "ahci.h" // process_ahci_op
 #include "virtio-blk.h" // process_virtio_blk_op
 #include "blockcmd.h" // cdb_*
+#include "trace.h" // trace_event
 
 u8 FloppyCount VARFSEG;
 u8 CDCount;
@@ -309,11 +310,9 @@ process_atapi_op(struct disk_op_s *op)
     }
 }
 
-// Execute a disk_op request.
-int
-process_op(struct disk_op_s *op)
+static int
+__process_op(struct disk_op_s *op)
 {
-    ASSERT16();
     u8 type = GET_GLOBAL(op->drive_g->type);
     switch (type) {
     case DTYPE_FLOPPY:
@@ -344,6 +343,18 @@ process_op(struct disk_op_s *op)
     }
 }
 
+// Execute a disk_op request.
+int
+process_op(struct disk_op_s *op)
+{
+    ASSERT16();
+    trace_event(TRACE_DISK_OP, (u32)op->drive_g, op->command
+                , (u32)op->lba, op->count);
+    int ret = __process_op(op);
+    trace_event(TRACE_DISK_DONE, ret, op->count, 0, 0);
+    return ret;
+}
+
 // Execute a "disk_op_s" request - this runs on the extra stack.
 static int
 __send_disk_op(struct disk_op_s *op_far, u16 op_seg)
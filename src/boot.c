@@ -23,9 +23,99 @@
  * Boot priority ordering
  ****************************************************************/
 
-static char **Bootorder VARVERIFY32INIT;
+// A bootorder entry (or a search pattern) split into its path
+// components - for example: /pci@i0cf8/scsi@3/channel@0/disk@1,0
+#define BOOTPATH_MAX 16
+
+struct bootcomp_s {
+    const char *name, *unit;
+    u8 namelen, unitlen;
+    u8 nval;            // number of numeric unit values (0 if not numeric)
+    u32 val[2];
+};
+
+struct bootpath_s {
+    u8 count;
+    u8 rom;             // ":romN" suffix on the last component
+    struct bootcomp_s comp[BOOTPATH_MAX];
+};
+
+static struct bootpath_s *Bootorder VARVERIFY32INIT;
 static int BootorderCount;
 
+// Parse a unit address such as "5", "1,2", or "i0cf8".
+static void
+parse_unit(struct bootcomp_s *c)
+{
+    const char *p = c->unit, *end = p + c->unitlen;
+    c->nval = 0;
+    while (p < end) {
+        if (c->nval >= ARRAY_SIZE(c->val))
+            goto fail;
+        u32 val = 0;
+        const char *start = p;
+        for (; p < end && *p != ','; p++) {
+            int d = *p;
+            if (d >= '0' && d <= '9')
+                d -= '0';
+            else if (d >= 'a' && d <= 'f')
+                d -= 'a' - 10;
+            else if (d >= 'A' && d <= 'F')
+                d -= 'A' - 10;
+            else
+                goto fail;
+            val = (val << 4) | d;
+        }
+        if (p == start)
+            goto fail;
+        c->val[c->nval++] = val;
+        if (p < end)
+            p++;
+    }
+    return;
+fail:
+    // Not numeric - compare as a string.
+    c->nval = 0;
+}
+
+// Split a path string into its components.
+static int
+parse_bootpath(const char *str, struct bootpath_s *bp)
+{
+    memset(bp, 0, sizeof(*bp));
+    const char *p = str;
+    if (*p == '/')
+        p++;
+    while (*p) {
+        if (bp->count >= BOOTPATH_MAX)
+            return -1;
+        struct bootcomp_s *c = &bp->comp[bp->count++];
+        c->name = p;
+        while (*p && *p != '/' && *p != '@' && *p != ':')
+            p++;
+        c->namelen = p - c->name;
+        if (*p == '@') {
+            c->unit = ++p;
+            while (*p && *p != '/' && *p != ':')
+                p++;
+            c->unitlen = p - c->unit;
+            parse_unit(c);
+        }
+        if (*p == ':') {
+            if (memcmp(p, ":rom", 4) != 0)
+                return -1;
+            p += 4;
+            while (*p >= '0' && *p <= '9')
+                bp->rom = bp->rom * 10 + *p++ - '0';
+            if (*p)
+                return -1;
+        }
+        if (*p == '/')
+            p++;
+    }
+    return 0;
+}
+
 static void
 loadBootOrder(void)
 {
@@ -36,89 +126,174 @@ loadBootOrder(void)
     if (!f)
         return;
 
-    int i = 0;
-    BootorderCount = 1;
+    int i = 0, count = 1;
     while (f[i]) {
         if (f[i] == '\n')
-            BootorderCount++;
+            count++;
         i++;
     }
-    Bootorder = malloc_tmphigh(BootorderCount*sizeof(char*));
+    Bootorder = malloc_tmphigh(count*sizeof(Bootorder[0]));
     if (!Bootorder) {
         warn_noalloc();
         free(f);
-        BootorderCount = 0;
         return;
     }
 
+    // The parsed entries point into the file data - so it isn't freed.
     dprintf(3, "boot order:\n");
     i = 0;
     do {
-        Bootorder[i] = f;
+        char *line = f;
         f = strchr(f, '\n');
         if (f)
             *(f++) = '\0';
-        nullTrailingSpace(Bootorder[i]);
-        dprintf(3, "%d: %s\n", i+1, Bootorder[i]);
+        nullTrailingSpace(line);
+        dprintf(3, "%d: %s\n", i+1, line);
+        if (parse_bootpath(line, &Bootorder[i])) {
+            dprintf(1, "Unable to parse bootorder entry %d: %s\n", i+1, line);
+            // Don't let the components parsed so far match anything.
+            Bootorder[i].count = BOOTPATH_MAX + 1;
+        }
         i++;
     } while (f);
+    BootorderCount = count;
 }
 
-// See if 'str' starts with 'glob' - if glob contains an '*' character
-// it will match any number of characters in str that aren't a '/' or
-// the next glob character.
-static char *
-glob_prefix(const char *glob, const char *str)
+// Check if a search pattern component matches a bootorder component.
+// A trailing '*' in the pattern name matches any name suffix.
+static int
+bootcomp_match(struct bootcomp_s *pat, struct bootcomp_s *c)
+{
+    int len = pat->namelen;
+    if (len && pat->name[len-1] == '*') {
+        len--;
+        if (c->namelen < len)
+            return 0;
+    } else if (c->namelen != len) {
+        return 0;
+    }
+    if (memcmp(pat->name, c->name, len) != 0)
+        return 0;
+    if (!pat->unit != !c->unit)
+        return 0;
+    if (pat->nval || c->nval)
+        // Numeric units - a missing trailing value is zero.
+        return (pat->nval && c->nval && pat->val[0] == c->val[0]
+                && (pat->nval > 1 ? pat->val[1] : 0)
+                   == (c->nval > 1 ? c->val[1] : 0));
+    return (pat->unitlen == c->unitlen
+            && memcmp(pat->unit, c->unit, c->unitlen) == 0);
+}
+
+// Search the bootorder list for the first entry that starts with the
+// given path.  Paths with a count above BOOTPATH_MAX never match.
+static int
+find_prio_path(struct bootpath_s *pat)
 {
-    for (;;) {
-        if (!*glob && (!*str || *str == '/'))
-            return (char*)str;
-        if (*glob == '*') {
-            if (!*str || *str == '/' || *str == glob[1])
-                glob++;
-            else
-                str++;
+    if (pat->count > BOOTPATH_MAX)
+        return -1;
+    int i, j;
+    for (i = 0; i < BootorderCount; i++) {
+        struct bootpath_s *bp = &Bootorder[i];
+        // A ":romN" suffix is only valid on the last component.
+        if (bp->count > BOOTPATH_MAX || bp->count < pat->count
+            || (bp->count == pat->count ? bp->rom != pat->rom : pat->rom))
             continue;
-        }
-        if (*glob != *str)
-            return NULL;
-        glob++;
-        str++;
+        for (j = 0; j < pat->count; j++)
+            if (!bootcomp_match(&pat->comp[j], &bp->comp[j]))
+                break;
+        if (j == pat->count)
+            return i+1;
     }
+    return -1;
 }
 
-// Search the bootorder list for the given glob pattern.
+// Search the bootorder list for the given pattern string.
 static int
 find_prio(const char *glob)
 {
     dprintf(1, "Searching bootorder for: %s\n", glob);
+    struct bootpath_s pat;
+    if (parse_bootpath(glob, &pat))
+        return -1;
+    return find_prio_path(&pat);
+}
+
+// Append a component to a search pattern.
+static struct bootcomp_s *
+bootpath_add(struct bootpath_s *bp, const char *name)
+{
+    if (bp->count >= BOOTPATH_MAX) {
+        // Too long to match any bootorder entry.
+        bp->count = BOOTPATH_MAX + 1;
+        return &bp->comp[BOOTPATH_MAX-1];
+    }
+    struct bootcomp_s *c = &bp->comp[bp->count++];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->namelen = strlen(name);
+    return c;
+}
+
+// Append a component with a numeric unit address ("name@v0,v1").
+static void
+bootpath_add_unit(struct bootpath_s *bp, const char *name, int nval
+                  , u32 v0, u32 v1)
+{
+    struct bootcomp_s *c = bootpath_add(bp, name);
+    c->unit = "";
+    c->nval = nval;
+    c->val[0] = v0;
+    c->val[1] = v1;
+}
+
+static void
+dump_bootpath(struct bootpath_s *bp)
+{
     int i;
-    for (i = 0; i < BootorderCount; i++)
-        if (glob_prefix(glob, Bootorder[i]))
-            return i+1;
-    return -1;
+    dprintf(1, "Searching bootorder for: ");
+    for (i = 0; i < bp->count && i < BOOTPATH_MAX; i++) {
+        struct bootcomp_s *c = &bp->comp[i];
+        dprintf(1, "/%s", c->name);
+        if (c->nval)
+            dprintf(1, "@%x", c->val[0]);
+        if (c->nval > 1)
+            dprintf(1, ",%x", c->val[1]);
+        if (!c->nval && c->unitlen)
+            dprintf(1, "@%s", c->unit);
+    }
+    if (bp->rom)
+        dprintf(1, ":rom%d", bp->rom);
+    dprintf(1, "\n");
+}
+
+static int
+find_prio_dump(struct bootpath_s *bp)
+{
+    dump_bootpath(bp);
+    return find_prio_path(bp);
 }
 
-#define FW_PCI_DOMAIN "/pci@i0cf8"
+#define FW_PCI_DOMAIN "i0cf8"
 
-static char *
-build_pci_path(char *buf, int max, const char *devname, struct pci_device *pci)
+static void
+build_pci_path(struct bootpath_s *bp, const char *devname
+               , struct pci_device *pci)
 {
-    // Build the string path of a bdf - for example: /pci@i0cf8/isa@1,2
-    char *p = buf;
+    // Build the path of a bdf - for example: /pci@i0cf8/isa@1,2
     if (pci->parent) {
-        p = build_pci_path(p, max, "pci-bridge", pci->parent);
+        build_pci_path(bp, "pci-bridge", pci->parent);
     } else {
+        memset(bp, 0, sizeof(*bp));
         if (pci->rootbus)
-            p += snprintf(p, max, "/pci-root@%x", pci->rootbus);
-        p += snprintf(p, buf+max-p, "%s", FW_PCI_DOMAIN);
+            bootpath_add_unit(bp, "pci-root", 1, pci->rootbus, 0);
+        struct bootcomp_s *c = bootpath_add(bp, "pci");
+        c->unit = FW_PCI_DOMAIN;
+        c->unitlen = strlen(FW_PCI_DOMAIN);
     }
 
     int dev = pci_bdf_to_dev(pci->bdf), fn = pci_bdf_to_fn(pci->bdf);
-    p += snprintf(p, buf+max-p, "/%s@%x", devname, dev);
-    if (fn)
-        p += snprintf(p, buf+max-p, ",%x", fn);
-    return p;
+    bootpath_add_unit(bp, devname, fn ? 2 : 1, dev, fn);
 }
 
 int bootprio_find_pci_device(struct pci_device *pci)
@@ -128,9 +303,9 @@ int bootprio_find_pci_device(struct pci_device *pci)
     if (!CONFIG_BOOTORDER)
         return -1;
     // Find pci device - for example: /pci@i0cf8/ethernet@5
-    char desc[256];
-    build_pci_path(desc, sizeof(desc), "*", pci);
-    return find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "*", pci);
+    return find_prio_dump(&bp);
 }
 
 int bootprio_find_scsi_device(struct pci_device *pci, int target, int lun)
@@ -141,10 +316,11 @@ int bootprio_find_scsi_device(struct pci_device *pci, int target, int lun)
         // support only pci machine for now
         return -1;
     // Find scsi drive - for example: /pci@i0cf8/scsi@5/channel@0/disk@1,0
-    char desc[256], *p;
-    p = build_pci_path(desc, sizeof(desc), "*", pci);
-    snprintf(p, desc+sizeof(desc)-p, "/*@0/*@%d,%d", target, lun);
-    return find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "*", pci);
+    bootpath_add_unit(&bp, "*", 1, 0, 0);
+    bootpath_add_unit(&bp, "*", 2, target, lun);
+    return find_prio_dump(&bp);
 }
 
 int bootprio_find_ata_device(struct pci_device *pci, int chanid, int slave)
@@ -157,10 +333,11 @@ int bootprio_find_ata_device(struct pci_device *pci, int chanid, int slave)
         // support only pci machine for now
         return -1;
     // Find ata drive - for example: /pci@i0cf8/ide@1,1/drive@1/disk@0
-    char desc[256], *p;
-    p = build_pci_path(desc, sizeof(desc), "*", pci);
-    snprintf(p, desc+sizeof(desc)-p, "/drive@%x/disk@%x", chanid, slave);
-    return find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "*", pci);
+    bootpath_add_unit(&bp, "drive", 1, chanid, 0);
+    bootpath_add_unit(&bp, "disk", 1, slave, 0);
+    return find_prio_dump(&bp);
 }
 
 int bootprio_find_fdc_device(struct pci_device *pci, int port, int fdid)
@@ -173,10 +350,11 @@ int bootprio_find_fdc_device(struct pci_device *pci, int port, int fdid)
         // support only pci machine for now
         return -1;
     // Find floppy - for example: /pci@i0cf8/isa@1/fdc@03f1/floppy@0
-    char desc[256], *p;
-    p = build_pci_path(desc, sizeof(desc), "isa", pci);
-    snprintf(p, desc+sizeof(desc)-p, "/fdc@%04x/floppy@%x", port, fdid);
-    return find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "isa", pci);
+    bootpath_add_unit(&bp, "fdc", 1, port, 0);
+    bootpath_add_unit(&bp, "floppy", 1, fdid, 0);
+    return find_prio_dump(&bp);
 }
 
 int bootprio_find_pci_rom(struct pci_device *pci, int instance)
@@ -184,11 +362,10 @@ int bootprio_find_pci_rom(struct pci_device *pci, int instance)
     if (!CONFIG_BOOTORDER)
         return -1;
     // Find pci rom - for example: /pci@i0cf8/scsi@3:rom2
-    char desc[256], *p;
-    p = build_pci_path(desc, sizeof(desc), "*", pci);
-    if (instance)
-        snprintf(p, desc+sizeof(desc)-p, ":rom%d", instance);
-    return find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "*", pci);
+    bp.rom = instance;
+    return find_prio_dump(&bp);
 }
 
 int bootprio_find_named_rom(const char *name, int instance)
@@ -203,15 +380,14 @@ int bootprio_find_named_rom(const char *name, int instance)
     return find_prio(desc);
 }
 
-static char *
-build_usb_path(char *buf, int max, struct usbhub_s *hub)
+static void
+build_usb_path(struct bootpath_s *bp, struct usbhub_s *hub)
 {
     if (!hub->usbdev)
         // Root hub - nothing to add.
-        return buf;
-    char *p = build_usb_path(buf, max, hub->usbdev->hub);
-    p += snprintf(p, buf+max-p, "/hub@%x", hub->usbdev->port+1);
-    return p;
+        return;
+    build_usb_path(bp, hub->usbdev->hub);
+    bootpath_add_unit(bp, "hub", 1, hub->usbdev->port+1, 0);
 }
 
 int bootprio_find_usb(struct usbdevice_s *usbdev, int lun)
@@ -219,26 +395,30 @@ int bootprio_find_usb(struct usbdevice_s *usbdev, int lun)
     if (!CONFIG_BOOTORDER)
         return -1;
     // Find usb - for example: /pci@i0cf8/usb@1,2/storage@1/channel@0/disk@0,0
-    char desc[256], *p;
-    p = build_pci_path(desc, sizeof(desc), "usb", usbdev->hub->cntl->pci);
-    p = build_usb_path(p, desc+sizeof(desc)-p, usbdev->hub);
-    snprintf(p, desc+sizeof(desc)-p, "/storage@%x/*@0/*@0,%d"
-             , usbdev->port+1, lun);
-    int ret = find_prio(desc);
+    struct bootpath_s bp;
+    build_pci_path(&bp, "usb", usbdev->hub->cntl->pci);
+    build_usb_path(&bp, usbdev->hub);
+    int count = bp.count;
+    bootpath_add_unit(&bp, "storage", 1, usbdev->port+1, 0);
+    bootpath_add_unit(&bp, "*", 1, 0, 0);
+    bootpath_add_unit(&bp, "*", 2, 0, lun);
+    int ret = find_prio_dump(&bp);
     if (ret >= 0)
         return ret;
     // Try usb-host/redir - for example: /pci@i0cf8/usb@1,2/usb-host@1
-    snprintf(p, desc+sizeof(desc)-p, "/usb-*@%x", usbdev->port+1);
-    return find_prio(desc);
+    bp.count = count;
+    bootpath_add_unit(&bp, "usb-*", 1, usbdev->port+1, 0);
+    return find_prio_dump(&bp);
 }
 
-
 /****************************************************************
  * Boot setup
  ****************************************************************/
 
 static int BootRetryTime;
 static int CheckFloppySig = 1;
+static int FastBoot;
+static int BootFirstReady;
 
 #define DEFAULT_PRIO           9999
 
@@ -275,10 +455,35 @@ boot_init(void)
     }
 
     BootRetryTime = romfile_loadint("etc/boot-fail-wait", 60*1000);
+    FastBoot = romfile_loadint("etc/fast-boot", 0);
 
     loadBootOrder();
 }
 
+// In fast boot mode, check if a device that no bootorder entry refers
+// to (a priority of -1) can be skipped.
+int
+boot_skip_prio(int prio)
+{
+    return CONFIG_BOOTORDER && FastBoot && BootorderCount && prio < 0;
+}
+
+// In fast boot mode, check if a pci device can be skipped because no
+// bootorder entry refers to it (or to a device behind it).
+int
+boot_skip_pci(struct pci_device *pci)
+{
+    if (!CONFIG_BOOTORDER || !FastBoot || !BootorderCount || !pci)
+        return 0;
+    struct bootpath_s bp;
+    build_pci_path(&bp, "*", pci);
+    if (find_prio_path(&bp) >= 0)
+        return 0;
+    dprintf(3, "Fast boot: skipping %02x:%02x.%x\n"
+            , pci_bdf_to_bus(pci->bdf), pci_bdf_to_dev(pci->bdf)
+            , pci_bdf_to_fn(pci->bdf));
+    return 1;
+}
 
 /****************************************************************
  * BootList handling
@@ -321,6 +526,12 @@ bootentry_add(int type, int prio, u32 data, const char *desc)
     be->description = desc ?: "?";
     dprintf(3, "Registering bootable: %s (type:%d prio:%d data:%x)\n"
             , be->description, type, prio, data);
+    if (prio == 1 && !BootFirstReady) {
+        // The first bootorder entry is present - nothing can sort ahead.
+        dprintf(1, "First bootorder device registered: %s\n"
+                , be->description);
+        BootFirstReady = 1;
+    }
 
     // Add entry in sorted order.
     struct hlist_node **pprev;
@@ -402,13 +613,32 @@ boot_add_cbfs(void *data, const char *desc, int prio)
 
 #define DEFAULT_BOOTMENU_WAIT 2500
 
+// Wait for the hardware init threads.  In fast boot mode, stop
+// waiting once the first bootorder device is registered and cancel
+// the remaining threads.
+void
+boot_wait_threads(void)
+{
+    if (!CONFIG_THREAD_EARLY_BOOT || !FastBoot || !BootorderCount) {
+        wait_threads();
+        return;
+    }
+    wait_threads_until(&BootFirstReady);
+    u64 start = get_tsc();
+    int count = cancel_threads();
+    if (count)
+        dprintf(1, "Fast boot: cancelled %d init threads in %d us\n"
+                , count, tsc_to_usec(get_tsc() - start));
+}
+
 // Show IPL option menu.
 void
 interactive_bootmenu(void)
 {
     // XXX - show available drives?
 
-    if (! CONFIG_BOOTMENU || !romfile_loadint("etc/show-boot-menu", 1))
+    if (! CONFIG_BOOTMENU || FastBoot
+        || !romfile_loadint("etc/show-boot-menu", 1))
         return;
 
     while (get_keystroke(0) >= 0)
@@ -462,6 +692,32 @@ interactive_bootmenu(void)
     hlist_add_head(&pos->node, &BootList);
 }
 
+// Run the deferred option roms whose BEVs come before the first
+// regular boot device in the boot order - the others are dropped.
+void
+boot_lazy_roms(void)
+{
+    if (! CONFIG_BOOT || ! CONFIG_OPTIONROMS_LAZY)
+        return;
+
+    struct bootentry_s *pos;
+    hlist_for_each_entry(pos, &BootList, node) {
+        if (pos->type != IPL_TYPE_BEV)
+            break;
+        optionrom_run_deferred(pos->vector.seg);
+    }
+
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(pos, n, &BootList, node) {
+        if (pos->type != IPL_TYPE_BEV
+            || !optionrom_is_deferred(pos->vector.seg))
+            continue;
+        dprintf(1, "Skipping unneeded boot rom: %s\n", pos->description);
+        hlist_del(&pos->node);
+        free(pos);
+    }
+}
+
 // BEV (Boot Execution Vector) list
 struct bev_s {
     int type;
@@ -11,7 +11,9 @@ void boot_add_floppy(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_hd(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_cd(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_cbfs(void *data, const char *desc, int prio);
+void boot_wait_threads(void);
 void interactive_bootmenu(void);
+void boot_lazy_roms(void);
 void bcv_prepboot(void);
 struct pci_device;
 int bootprio_find_pci_device(struct pci_device *pci);
@@ -22,5 +24,7 @@ int bootprio_find_pci_rom(struct pci_device *pci, int instance);
 int bootprio_find_named_rom(const char *name, int instance);
 struct usbdevice_s;
 int bootprio_find_usb(struct usbdevice_s *usbdev, int lun);
+int boot_skip_pci(struct pci_device *pci);
+int boot_skip_prio(int prio);
 
 #endif // __BOOT_H
@@ -0,0 +1,106 @@
+// Boot time profiling of POST phases, device setup, and threads.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "config.h" // CONFIG_*
+#include "util.h" // dprintf
+#include "memmap.h" // add_e820
+
+#define BOOTPROF_SIGNATURE 0x46525042 // BPRF
+#define BOOTPROF_ENTRIES 128
+
+// Layout of the profile data (exported to the OS in a reserved e820
+// region, so all fields are fixed size).
+struct bootprof_entry_s {
+    char name[20];
+    u32 func;
+    u64 start, end;
+} PACKED;
+
+struct bootprof_s {
+    u32 signature;
+    u32 length;
+    u32 count;
+    u32 cpu_khz;
+    struct bootprof_entry_s entries[BOOTPROF_ENTRIES];
+} PACKED;
+
+static struct bootprof_s *BootProf VARVERIFY32INIT;
+
+void
+bootprof_init(void)
+{
+    if (!CONFIG_DEBUG_BOOTPROF)
+        return;
+    struct bootprof_s *bp = memalign_tmphigh(PAGE_SIZE, sizeof(*bp));
+    if (!bp) {
+        warn_noalloc();
+        return;
+    }
+    memset(bp, 0, sizeof(*bp));
+    bp->signature = BOOTPROF_SIGNATURE;
+    bp->length = sizeof(*bp);
+    BootProf = bp;
+}
+
+// Record the start of an event - returns an id for bootprof_end().
+int
+bootprof_begin(const char *name, void *func)
+{
+    struct bootprof_s *bp = BootProf;
+    if (!CONFIG_DEBUG_BOOTPROF || !bp || bp->count >= BOOTPROF_ENTRIES)
+        return -1;
+    struct bootprof_entry_s *e = &bp->entries[bp->count];
+    strtcpy(e->name, name, sizeof(e->name));
+    e->func = (u32)func;
+    e->start = get_tsc();
+    return bp->count++;
+}
+
+void
+bootprof_end(int id)
+{
+    struct bootprof_s *bp = BootProf;
+    if (!CONFIG_DEBUG_BOOTPROF || !bp || id < 0)
+        return;
+    bp->entries[id].end = get_tsc();
+}
+
+// Print the recorded events (longest first) and reserve the profile
+// data so that it remains available to the OS.
+void
+bootprof_report(void)
+{
+    struct bootprof_s *bp = BootProf;
+    if (!CONFIG_DEBUG_BOOTPROF || !bp)
+        return;
+    bp->cpu_khz = get_tsc_khz();
+
+    // Sort by duration
+    u8 order[BOOTPROF_ENTRIES];
+    u32 us[BOOTPROF_ENTRIES];
+    int i, j;
+    for (i=0; i<bp->count; i++) {
+        struct bootprof_entry_s *e = &bp->entries[i];
+        us[i] = e->end ? tsc_to_usec(e->end - e->start) : 0;
+        for (j=i; j>0 && us[order[j-1]] < us[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+
+    u64 first = bp->count ? bp->entries[0].start : 0;
+    dprintf(1, "Boot profile (%d events):\n", bp->count);
+    for (i=0; i<bp->count; i++) {
+        struct bootprof_entry_s *e = &bp->entries[order[i]];
+        u32 at = tsc_to_usec(e->start - first);
+        if (e->func)
+            dprintf(1, "  %9d us at %9d us: %s %x\n"
+                    , us[order[i]], at, e->name, e->func);
+        else
+            dprintf(1, "  %9d us at %9d us: %s%s\n"
+                    , us[order[i]], at, e->name, e->end ? "" : " (running)");
+    }
+
+    add_e820((u32)bp, ALIGN(sizeof(*bp), PAGE_SIZE), E820_RESERVED);
+    dprintf(1, "Boot profile data at %p\n", bp);
+}
@@ -90,6 +90,23 @@ find_videomode(struct vbe_info *vesa_info, struct vbe_mode_info *mode_info
 }
 
 static int BootsplashActive;
+static struct romfile_preload_s *BootsplashPreload;
+static u8 BootsplashPreloadType;
+
+// Start loading the splash picture in the background.
+void
+preload_bootsplash(void)
+{
+    if (!CONFIG_BOOTSPLASH || !romfile_loadint("etc/show-boot-menu", 1))
+        return;
+    struct romfile_s *file = romfile_find("bootsplash.jpg");
+    BootsplashPreloadType = 0;
+    if (!file) {
+        file = romfile_find("bootsplash.bmp");
+        BootsplashPreloadType = 1;
+    }
+    BootsplashPreload = romfile_preload(file);
+}
 
 void
 enable_bootsplash(void)
@@ -100,12 +117,21 @@ enable_bootsplash(void)
     dprintf(3, "Checking for bootsplash\n");
     u8 type = 0; /* 0 means jpg, 1 means bmp, default is 0=jpg */
     int filesize;
-    u8 *filedata = romfile_loadfile("bootsplash.jpg", &filesize);
-    if (!filedata) {
-        filedata = romfile_loadfile("bootsplash.bmp", &filesize);
+    u8 *filedata;
+    if (BootsplashPreload) {
+        type = BootsplashPreloadType;
+        filedata = romfile_preload_finish(BootsplashPreload, &filesize);
+        BootsplashPreload = NULL;
         if (!filedata)
             return;
-        type = 1;
+    } else {
+        filedata = romfile_loadfile("bootsplash.jpg", &filesize);
+        if (!filedata) {
+            filedata = romfile_loadfile("bootsplash.bmp", &filesize);
+            if (!filedata)
+                return;
+            type = 1;
+        }
     }
     dprintf(3, "start showing bootsplash\n");
 
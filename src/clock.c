@@ -13,6 +13,7 @@
 #include "bregs.h" // struct bregs
 #include "biosvar.h" // GET_GLOBAL
 #include "usb-hid.h" // usb_check_event
+#include "trace.h" // trace_event, profile_sample
 
 // RTC register flags
 #define RTC_A_UIP 0x80
@@ -69,6 +70,48 @@ u16 pmtimer_ioport VARFSEG;
 u32 pmtimer_wraps VARLOW;
 u32 pmtimer_last VARLOW;
 
+#define CPUID_EXT_HYPERVISOR (1 << 31)
+
+// Obtain the TSC frequency from cpuid, the hypervisor timing leaf, or
+// fw_cfg so that it need not be calibrated.  Returns 0 if not known.
+static u32
+tsc_khz_lookup(u32 maxleaf, u32 features_ecx)
+{
+    u32 eax, ebx, ecx, edx;
+    u32 khz = romfile_loadint("etc/tsc-khz", 0);
+    if (khz) {
+        dprintf(3, "TSC frequency from fw_cfg\n");
+        return khz;
+    }
+    if (features_ecx & CPUID_EXT_HYPERVISOR) {
+        cpuid(0x40000000, &eax, &ebx, &ecx, &edx);
+        if (eax >= 0x40000010 && eax < 0x40010000) {
+            cpuid(0x40000010, &khz, &ebx, &ecx, &edx);
+            if (khz) {
+                dprintf(3, "TSC frequency from hypervisor leaf\n");
+                return khz;
+            }
+        }
+    }
+    if (maxleaf >= 0x15) {
+        // TSC/crystal clock ratio and crystal frequency
+        cpuid(0x15, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx) {
+            dprintf(3, "TSC frequency from cpuid leaf 0x15\n");
+            return ecx / 1000 * ebx / eax;
+        }
+    }
+    if (maxleaf >= 0x16) {
+        // Processor base frequency (in Mhz)
+        cpuid(0x16, &eax, &ebx, &ecx, &edx);
+        if (eax & 0xffff) {
+            dprintf(3, "TSC frequency from cpuid leaf 0x16\n");
+            return (eax & 0xffff) * 1000;
+        }
+    }
+    return 0;
+}
+
 static void
 calibrate_tsc(void)
 {
@@ -80,7 +123,8 @@ calibrate_tsc(void)
     }
 
     cpuid(0, &eax, &ebx, &ecx, &edx);
-    if (eax > 0)
+    u32 maxleaf = eax;
+    if (maxleaf > 0)
         cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
 
     if (!(cpuid_features & CPUID_TSC)) {
@@ -90,6 +134,13 @@ calibrate_tsc(void)
         return;
     }
 
+    u32 khz = tsc_khz_lookup(maxleaf, maxleaf > 0 ? ecx : 0);
+    if (khz) {
+        SET_GLOBAL(cpu_khz, khz);
+        dprintf(1, "CPU Mhz=%u\n", khz / 1000);
+        return;
+    }
+
     // Setup "timer2"
     u8 orig = inb(PORT_PS2_CTRLB);
     outb((orig & ~PPCB_SPKR) | PPCB_T2GATE, PORT_PS2_CTRLB);
@@ -164,8 +215,88 @@ static u64 pmtimer_get(void)
     return (u64)wraps << 24 | pmtimer;
 }
 
+
+/****************************************************************
+ * HPET timer
+ ****************************************************************/
+
+#define HPET_ID         0x000
+#define HPET_PERIOD     0x004
+#define HPET_CFG        0x010
+#define HPET_COUNTER    0x0f0
+
+#define HPET_CFG_ENABLE 0x001
+
+u32 hpet_khz VARFSEG;
+
+// Enable the hpet main counter (if present) for use as a clock source.
+void
+hpet_setup(void)
+{
+    if (!CONFIG_HPET_TIMER)
+        return;
+    void *hpet_base = (void*)BUILD_HPET_ADDRESS;
+    u32 hpet_vendor = readl(hpet_base + HPET_ID) >> 16;
+    u32 hpet_period = readl(hpet_base + HPET_PERIOD);
+    if (hpet_vendor == 0 || hpet_vendor == 0xffff ||
+        hpet_period < 1000 || hpet_period > 100000000)
+        return;
+    writel(hpet_base + HPET_CFG, readl(hpet_base + HPET_CFG) | HPET_CFG_ENABLE);
+    // The period is in femtoseconds
+    u32 khz = 1000000000 / (hpet_period / 1000);
+    dprintf(1, "Using hpet, freq %d kHz\n", khz);
+    SET_GLOBAL(hpet_khz, khz);
+}
+
+// The hpet is above 1MiB and can thus only be read in 32bit flat mode.
+// It is used there instead of the pmtimer or tsc emulation.
+static inline int
+use_hpet(void)
+{
+    return (CONFIG_HPET_TIMER && !MODESEGMENT && GET_GLOBAL(hpet_khz)
+            && (GET_GLOBAL(no_tsc)
+                || (CONFIG_PMTIMER && GET_GLOBAL(pmtimer_ioport))));
+}
+
 static u64
-get_tsc(void)
+hpet_get(void)
+{
+    void *counter = (void*)BUILD_HPET_ADDRESS + HPET_COUNTER;
+    u32 hi, lo;
+    do {
+        hi = readl(counter + 4);
+        lo = readl(counter);
+    } while (hi != readl(counter + 4));
+    return ((u64)hi << 32) | lo;
+}
+
+
+/****************************************************************
+ * Time source
+ ****************************************************************/
+
+// Return the frequency of the time returned by get_tsc_anymode().
+u32
+get_tsc_anymode_khz(void)
+{
+    return GET_GLOBAL(cpu_khz);
+}
+
+// Return the frequency of the time returned by get_tsc().
+u32
+get_tsc_khz(void)
+{
+    if (use_hpet())
+        return GET_GLOBAL(hpet_khz);
+    return get_tsc_anymode_khz();
+}
+
+// Return a time that is consistent in all cpu modes (it never uses
+// the hpet).  Its frequency is cpu_khz.  Times that are recorded in
+// one mode and used in another must come from here - get_tsc() times
+// are only comparable within the same mode.
+u64
+get_tsc_anymode(void)
 {
     if (unlikely(GET_GLOBAL(no_tsc)))
         return emulate_tsc();
@@ -174,18 +305,37 @@ get_tsc(void)
     return rdtscll();
 }
 
+u64
+get_tsc(void)
+{
+    if (use_hpet())
+        return hpet_get();
+    return get_tsc_anymode();
+}
+
+// Check if the given get_tsc() time has passed.
 int
-check_tsc(u64 end)
+__check_tsc(u64 end)
 {
     return (s64)(get_tsc() - end) > 0;
 }
 
+// Check if a timeout has expired.  The timeouts of a cancelled init
+// thread expire immediately so that it gives up on its device.
+int
+check_tsc(u64 end)
+{
+    if (!MODESEGMENT && thread_cancelled())
+        return 1;
+    return __check_tsc(end);
+}
+
 static void
 tscdelay(u64 diff)
 {
     u64 start = get_tsc();
     u64 end = start + diff;
-    while (!check_tsc(end))
+    while (!__check_tsc(end))
         cpu_relax();
 }
 
@@ -193,45 +343,59 @@ static void
 tscsleep(u64 diff)
 {
     u64 start = get_tsc();
-    u64 end = start + diff;
-    while (!check_tsc(end))
-        yield();
+    yield_until(start + diff);
 }
 
 void ndelay(u32 count) {
-    tscdelay(count * GET_GLOBAL(cpu_khz) / 1000000);
+    tscdelay(count * get_tsc_khz() / 1000000);
 }
 void udelay(u32 count) {
-    tscdelay(count * GET_GLOBAL(cpu_khz) / 1000);
+    tscdelay(count * get_tsc_khz() / 1000);
 }
 void mdelay(u32 count) {
-    tscdelay(count * GET_GLOBAL(cpu_khz));
+    tscdelay(count * get_tsc_khz());
 }
 
 void nsleep(u32 count) {
-    tscsleep(count * GET_GLOBAL(cpu_khz) / 1000000);
+    tscsleep(count * get_tsc_khz() / 1000000);
 }
 void usleep(u32 count) {
-    tscsleep(count * GET_GLOBAL(cpu_khz) / 1000);
+    tscsleep(count * get_tsc_khz() / 1000);
 }
 void msleep(u32 count) {
-    tscsleep(count * GET_GLOBAL(cpu_khz));
+    tscsleep(count * get_tsc_khz());
 }
 
 // Return the TSC value that is 'msecs' time in the future.
 u64
 calc_future_tsc(u32 msecs)
 {
-    u32 khz = GET_GLOBAL(cpu_khz);
+    u32 khz = get_tsc_khz();
     return get_tsc() + ((u64)khz * msecs);
 }
 u64
 calc_future_tsc_usec(u32 usecs)
 {
-    u32 khz = GET_GLOBAL(cpu_khz);
+    u32 khz = get_tsc_khz();
     return get_tsc() + ((u64)(khz/1000) * usecs);
 }
 
+// Convert a time delta (in get_tsc() units) to microseconds.
+u32
+tsc_to_usec(u64 ticks)
+{
+    u32 khz = get_tsc_khz();
+    if (!khz)
+        return 0;
+    // Avoid a 64bit division by dropping low order bits.
+    int shift = 0;
+    while (ticks > 0xffffffff / 1000) {
+        ticks >>= 1;
+        shift++;
+    }
+    return ((u32)ticks * 1000 / khz) << shift;
+}
+
 
 /****************************************************************
  * Init
@@ -294,6 +458,7 @@ timer_setup(void)
 {
     dprintf(3, "init timer\n");
     calibrate_tsc();
+    hpet_setup();
     pit_setup();
 
     rtc_setup();
@@ -359,6 +524,9 @@ check_timer(u32 end)
 static void
 handle_1a00(struct bregs *regs)
 {
+    // Option roms poll the tick count while waiting - run any pending
+    // threads here instead of only on the next rtc irq.
+    check_preempt();
     yield();
     u32 ticks = GET_BDA(timer_counter);
     regs->cx = ticks >> 16;
@@ -561,6 +729,8 @@ void VISIBLE16
 handle_08(void)
 {
     debug_isr(DEBUG_ISR_08);
+    if (!CONFIG_DEBUG_PROFILE_RTC)
+        profile_sample();
 
     // Update counter
     u32 counter = GET_BDA(timer_counter);
@@ -572,6 +742,7 @@ handle_08(void)
         SET_BDA(timer_rollover, GET_BDA(timer_rollover) + 1);
     }
     SET_BDA(timer_counter, counter);
+    trace_event(TRACE_TIMER_TICK, counter, 0, 0, 0);
 
     // Check for internal events.
     floppy_tick();
@@ -723,6 +894,8 @@ handle_70(void)
 
     // Handle Periodic Interrupt.
 
+    if (CONFIG_DEBUG_PROFILE_RTC)
+        profile_sample();
     check_preempt();
 
     if (!GET_BDA(rtc_wait_flag))
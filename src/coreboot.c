@@ -69,6 +69,14 @@ struct cb_forward {
 
 #define CB_TAG_FORWARD 0x11
 
+struct cb_cbmem_ref {
+    u32 tag;
+    u32 size;
+    u64 cbmem_addr;
+};
+
+#define CB_TAG_CBMEM_CONSOLE 0x17
+
 static u16
 ipchksum(char *buf, int count)
 {
@@ -173,6 +181,10 @@ coreboot_preinit(void)
         dprintf(1, "Found mainboard %s %s\n", CBvendor, CBpart);
     }
 
+    struct cb_cbmem_ref *cbcon = find_cb_subtable(cbh, CB_TAG_CBMEM_CONSOLE);
+    if (cbcon)
+        firmware_log_attach((void*)(u32)cbcon->cbmem_addr);
+
     return;
 
 fail:
@@ -183,6 +195,31 @@ fail:
 }
 
 
+// Place a minimal coreboot table in the f-segment that refers to the
+// firmware log so that coreboot's tools can find it.
+void
+coreboot_export_console(void *console)
+{
+    struct {
+        struct cb_header hdr;
+        struct cb_cbmem_ref con;
+    } *cbt = malloc_fseg(sizeof(*cbt));
+    if (!cbt) {
+        warn_noalloc();
+        return;
+    }
+    memset(cbt, 0, sizeof(*cbt));
+    cbt->con.tag = CB_TAG_CBMEM_CONSOLE;
+    cbt->con.size = sizeof(cbt->con);
+    cbt->con.cbmem_addr = (u32)console;
+    cbt->hdr.signature = CB_SIGNATURE;
+    cbt->hdr.header_bytes = sizeof(cbt->hdr);
+    cbt->hdr.table_bytes = sizeof(cbt->con);
+    cbt->hdr.table_entries = 1;
+    cbt->hdr.table_checksum = ipchksum((char*)&cbt->con, sizeof(cbt->con));
+    cbt->hdr.header_checksum = ipchksum((char*)&cbt->hdr, sizeof(cbt->hdr));
+}
+
 /****************************************************************
  * BIOS table copying
  ****************************************************************/
@@ -227,38 +264,73 @@ coreboot_platform_setup(void)
  * ulzma
  ****************************************************************/
 
+struct ulzma_job_s {
+    struct smp_job_s job;
+    CLzmaDecoderState state;
+    const u8 *src;
+    u8 *dst;
+    u32 srclen, dstlen;
+    int ret;
+};
+
+static void
+ulzma_decode(void *data)
+{
+    struct ulzma_job_s *uj = data;
+    u32 inProcessed, outProcessed;
+    uj->ret = LzmaDecode(&uj->state, uj->src + LZMA_PROPERTIES_SIZE + 8
+                         , uj->srclen, &inProcessed, uj->dst, uj->dstlen
+                         , &outProcessed);
+}
+
 // Uncompress data in flash to an area of memory.
 static int
 ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen)
 {
     dprintf(3, "Uncompressing data %d@%p to %d@%p\n", srclen, src, maxlen, dst);
-    CLzmaDecoderState state;
-    int ret = LzmaDecodeProperties(&state.Properties, src, LZMA_PROPERTIES_SIZE);
-    if (ret != LZMA_RESULT_OK) {
-        dprintf(1, "LzmaDecodeProperties error - %d\n", ret);
+    struct ulzma_job_s *uj = malloc_tmphigh(sizeof(*uj));
+    if (!uj) {
+        warn_noalloc();
         return -1;
     }
-    u8 scratch[15980];
-    int need = (LzmaGetNumProbs(&state.Properties) * sizeof(CProb));
-    if (need > sizeof(scratch)) {
-        dprintf(1, "LzmaDecode need %d have %d\n", need, (unsigned int)sizeof(scratch));
-        return -1;
+    int ret = LzmaDecodeProperties(&uj->state.Properties, src
+                                   , LZMA_PROPERTIES_SIZE);
+    if (ret != LZMA_RESULT_OK) {
+        dprintf(1, "LzmaDecodeProperties error - %d\n", ret);
+        goto fail;
     }
-    state.Probs = (CProb *)scratch;
-
     u32 dstlen = *(u32*)(src + LZMA_PROPERTIES_SIZE);
     if (dstlen > maxlen) {
         dprintf(1, "LzmaDecode too large (max %d need %d)\n", maxlen, dstlen);
-        return -1;
+        goto fail;
     }
-    u32 inProcessed, outProcessed;
-    ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8, srclen
-                     , &inProcessed, dst, dstlen, &outProcessed);
+    // The probability tables are kept off the stack so that the
+    // decoder can also run on thread and application processor stacks.
+    int need = (LzmaGetNumProbs(&uj->state.Properties) * sizeof(CProb));
+    uj->state.Probs = malloc_tmphigh(need);
+    if (!uj->state.Probs) {
+        warn_noalloc();
+        goto fail;
+    }
+    uj->src = src;
+    uj->srclen = srclen;
+    uj->dst = dst;
+    uj->dstlen = dstlen;
+    uj->job.func = ulzma_decode;
+    uj->job.data = uj;
+    smp_job_submit(&uj->job);
+    smp_job_wait(&uj->job);
+    free(uj->state.Probs);
+    ret = uj->ret;
+    free(uj);
     if (ret) {
         dprintf(1, "LzmaDecode returned %d\n", ret);
         return -1;
     }
     return dstlen;
+fail:
+    free(uj);
+    return -1;
 }
 
 
@@ -355,7 +427,7 @@ coreboot_cbfs_init(void)
         u64 magic = fhdr->magic;
         if (magic != CBFS_FILE_MAGIC)
             break;
-        struct cbfs_romfile_s *cfile = malloc_tmp(sizeof(*cfile));
+        struct cbfs_romfile_s *cfile = malloc_arena(sizeof(*cfile));
         if (!cfile) {
             warn_noalloc();
             break;
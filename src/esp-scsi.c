@@ -11,7 +11,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "util.h" // dprintf
-#include "pci.h" // foreachpci
+#include "pci.h" // foreachpci_id
 #include "config.h" // CONFIG_*
 #include "biosvar.h" // GET_GLOBAL
 #include "pci_ids.h" // PCI_DEVICE_ID
@@ -225,10 +225,12 @@ esp_scsi_setup(void)
     dprintf(3, "init esp\n");
 
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_id(pci, PCI_VENDOR_ID_AMD, PCI_DEVICE_ID_AMD_SCSI) {
         if (pci->vendor != PCI_VENDOR_ID_AMD
             || pci->device != PCI_DEVICE_ID_AMD_SCSI)
             continue;
+        if (boot_skip_pci(pci))
+            continue;
         init_esp_scsi(pci);
     }
 }
@@ -113,12 +113,14 @@ init_floppy(int floppyid, int ftype)
 static void
 addFloppy(int floppyid, int ftype)
 {
+    struct pci_device *pci = pci_find_class(PCI_CLASS_BRIDGE_ISA); /* isa-to-pci bridge */
+    int prio = bootprio_find_fdc_device(pci, PORT_FD_BASE, floppyid);
+    if (boot_skip_prio(prio))
+        return;
     struct drive_s *drive_g = init_floppy(floppyid, ftype);
     if (!drive_g)
         return;
     char *desc = znprintf(MAXDESCSIZE, "Floppy [drive %c]", 'A' + floppyid);
-    struct pci_device *pci = pci_find_class(PCI_CLASS_BRIDGE_ISA); /* isa-to-pci bridge */
-    int prio = bootprio_find_fdc_device(pci, PORT_FD_BASE, floppyid);
     boot_add_floppy(drive_g, desc, prio);
 }
 
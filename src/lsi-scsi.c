@@ -11,7 +11,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "util.h" // dprintf
-#include "pci.h" // foreachpci
+#include "pci.h" // foreachpci_id
 #include "config.h" // CONFIG_*
 #include "biosvar.h" // GET_GLOBAL
 #include "pci_ids.h" // PCI_DEVICE_ID_VIRTIO_BLK
@@ -204,10 +204,13 @@ lsi_scsi_setup(void)
     dprintf(3, "init lsi53c895a\n");
 
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_id(pci, PCI_VENDOR_ID_LSI_LOGIC
+                  , PCI_DEVICE_ID_LSI_53C895A) {
         if (pci->vendor != PCI_VENDOR_ID_LSI_LOGIC
             || pci->device != PCI_DEVICE_ID_LSI_53C895A)
             continue;
+        if (boot_skip_pci(pci))
+            continue;
         init_lsi_scsi(pci);
     }
 }
@@ -49,10 +49,10 @@ mptable_setup(void)
     }
     u8 apic_version = readl((u8*)BUILD_APIC_ADDR + 0x30) & 0xff;
 
-    // CPU definitions.
+    // CPU definitions (the MP spec only supports 8-bit APIC IDs).
     struct mpt_cpu *cpus = (void*)&config[1], *cpu = cpus;
     int i;
-    for (i = 0; i < MaxCountCPUs; i+=pkgcpus) {
+    for (i = 0; i < MaxCountCPUs && i < 0xff; i+=pkgcpus) {
         memset(cpu, 0, sizeof(*cpu));
         cpu->type = MPT_TYPE_CPU;
         cpu->apicid = i;
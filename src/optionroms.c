@@ -115,6 +115,66 @@ get_pci_rom(struct rom_header *rom)
     return pd;
 }
 
+// Option roms whose init code hasn't been run yet.
+struct lazyrom_s {
+    u16 seg, bdf;
+};
+static struct lazyrom_s LazyRoms[16];
+static int LazyRomCount;
+
+// Check if a rom only provides boot entry vectors - if so, note it so
+// that its init code is only run if the rom is needed for booting.
+// Roms with a BCV (storage controllers) are always run, as their
+// drives may be needed by the hard disk boot entry.
+static int
+defer_optionrom(struct rom_header *rom, u16 bdf)
+{
+    if (!CONFIG_OPTIONROMS_LAZY || LazyRomCount >= ARRAY_SIZE(LazyRoms))
+        return 0;
+    struct pnp_data *pnp = get_pnp_rom(rom);
+    while (pnp) {
+        if (!pnp->bev || pnp->bcv)
+            return 0;
+        pnp = get_pnp_next(rom, pnp);
+    }
+    struct lazyrom_s *lr = &LazyRoms[LazyRomCount++];
+    lr->seg = FLATPTR_TO_SEG(rom);
+    lr->bdf = bdf;
+    dprintf(1, "Deferring init of option rom at %04x:0003\n", lr->seg);
+    return 1;
+}
+
+static struct lazyrom_s *
+find_lazyrom(u16 seg)
+{
+    int i;
+    for (i=0; i<LazyRomCount; i++)
+        if (LazyRoms[i].seg == seg)
+            return &LazyRoms[i];
+    return NULL;
+}
+
+// Check if the rom at the given segment has a deferred init.
+int
+optionrom_is_deferred(u16 seg)
+{
+    return CONFIG_OPTIONROMS_LAZY && find_lazyrom(seg) != NULL;
+}
+
+// Run the deferred init code of the rom at the given segment.
+void
+optionrom_run_deferred(u16 seg)
+{
+    if (!CONFIG_OPTIONROMS_LAZY)
+        return;
+    struct lazyrom_s *lr = find_lazyrom(seg);
+    if (!lr)
+        return;
+    u16 bdf = lr->bdf;
+    *lr = LazyRoms[--LazyRomCount];
+    callrom(MAKE_FLATPTR(seg, 0), bdf);
+}
+
 // Run rom init code and note rom size.
 static int
 init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
@@ -129,7 +189,7 @@ init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
     if (newrom != rom)
         memmove(newrom, rom, rom->size * 512);
 
-    if (isvga || get_pnp_rom(newrom))
+    if (isvga || (get_pnp_rom(newrom) && !defer_optionrom(newrom, bdf)))
         // Only init vga and PnP roms here.
         callrom(newrom, bdf);
 
@@ -158,6 +218,160 @@ getRomPriority(u64 *sources, struct rom_header *rom, int instance)
 }
 
 
+/****************************************************************
+ * Option rom cache
+ ****************************************************************/
+
+// Copies of the rom images loaded on the previous boot (taken before
+// their init code ran) are kept in a reserved area at the top of ram
+// (see malloc_preinit) so that a reboot doesn't need to read or
+// uncompress them again.
+#define ROMCACHE_SIGNATURE 0x43524253 // SBRC
+#define ROMCACHE_ENTRIES 32
+#define ROMCACHE_ALIGN 16
+#define FNV_INIT 0x811c9dc5
+
+struct romcache_entry_s {
+    u32 key, size, sum;
+};
+
+struct romcache_s {
+    u32 signature;
+    u32 fingerprint;
+    u32 count;
+    u32 used;
+    struct romcache_entry_s entries[ROMCACHE_ENTRIES];
+    u8 data[];
+};
+
+void *RomCache VARVERIFY32INIT;
+
+#define ROMCACHE_SPACE (BUILD_ROMCACHE_SIZE - sizeof(struct romcache_s))
+
+static u32
+romcache_hash(u32 hash, const void *data, u32 len)
+{
+    const u8 *p = data;
+    while (len--)
+        hash = (hash ^ *p++) * 0x01000193;
+    return hash;
+}
+
+static u32
+romcache_filekey(struct romfile_s *file)
+{
+    u32 key = romcache_hash(FNV_INIT, file->name, strlen(file->name));
+    return romcache_hash(key, &file->size, sizeof(file->size));
+}
+
+static u32
+romcache_pcikey(struct pci_device *pci)
+{
+    u16 ids[3] = { pci->bdf, pci->vendor, pci->device };
+    return romcache_hash(FNV_INIT, ids, sizeof(ids));
+}
+
+// Check if the cache from the last boot is still valid for the
+// current set of PCI devices - start a new cache if not.
+static void
+romcache_setup(void)
+{
+    struct romcache_s *rc = RomCache;
+    if (!CONFIG_OPTIONROMS_CACHE || !rc)
+        return;
+    u32 fingerprint = FNV_INIT;
+    struct pci_device *pci;
+    foreachpci(pci) {
+        u16 ids[5] = { pci->bdf, pci->vendor, pci->device, pci->class
+                       , pci->revision };
+        fingerprint = romcache_hash(fingerprint, ids, sizeof(ids));
+    }
+    if (rc->signature == ROMCACHE_SIGNATURE && rc->fingerprint == fingerprint
+        && rc->count <= ROMCACHE_ENTRIES && rc->used <= ROMCACHE_SPACE) {
+        u32 used = 0;
+        int i;
+        for (i=0; i<rc->count; i++)
+            used += ALIGN(rc->entries[i].size, ROMCACHE_ALIGN);
+        if (used == rc->used) {
+            dprintf(1, "Option rom cache has %d roms from last boot\n"
+                    , rc->count);
+            return;
+        }
+    }
+    dprintf(3, "Starting new option rom cache at %p\n", rc);
+    rc->signature = ROMCACHE_SIGNATURE;
+    rc->fingerprint = fingerprint;
+    rc->count = rc->used = 0;
+}
+
+// Find a cached rom image with the given key and size.
+static void *
+romcache_find(u32 key, u32 size)
+{
+    struct romcache_s *rc = RomCache;
+    if (!CONFIG_OPTIONROMS_CACHE || !rc || rc->signature != ROMCACHE_SIGNATURE)
+        return NULL;
+    u32 offset = 0;
+    int i;
+    for (i=0; i<rc->count; i++) {
+        struct romcache_entry_s *entry = &rc->entries[i];
+        void *data = rc->data + offset;
+        offset += ALIGN(entry->size, ROMCACHE_ALIGN);
+        if (entry->key != key || entry->size != size)
+            continue;
+        if (romcache_hash(FNV_INIT, data, size) != entry->sum) {
+            // Corrupted - drop this and all later entries.
+            dprintf(1, "Option rom cache entry %d is corrupt\n", i);
+            rc->count = i;
+            rc->used = offset - ALIGN(entry->size, ROMCACHE_ALIGN);
+            return NULL;
+        }
+        return data;
+    }
+    return NULL;
+}
+
+// Copy a cached rom image to option rom memory.
+static struct rom_header *
+romcache_load(u32 key, u32 size)
+{
+    void *data = romcache_find(key, size);
+    if (!data)
+        return NULL;
+    struct rom_header *rom = rom_reserve(size);
+    if (!rom) {
+        warn_noalloc();
+        return NULL;
+    }
+    dprintf(4, "Copying cached option rom (size %d) from %p to %p\n"
+            , size, data, rom);
+    memcpy(rom, data, size);
+    return rom;
+}
+
+// Add a newly loaded rom image to the cache.
+static void
+romcache_store(u32 key, struct rom_header *rom, u32 size)
+{
+    struct romcache_s *rc = RomCache;
+    if (!CONFIG_OPTIONROMS_CACHE || !rc || rc->signature != ROMCACHE_SIGNATURE)
+        return;
+    if (rc->count >= ROMCACHE_ENTRIES
+        || rc->used + ALIGN(size, ROMCACHE_ALIGN) > ROMCACHE_SPACE) {
+        dprintf(1, "Option rom cache full - not caching rom of size %d\n"
+                , size);
+        return;
+    }
+    struct romcache_entry_s *entry = &rc->entries[rc->count];
+    memcpy(rc->data + rc->used, rom, size);
+    entry->key = key;
+    entry->size = size;
+    entry->sum = romcache_hash(FNV_INIT, rom, size);
+    rc->used += ALIGN(size, ROMCACHE_ALIGN);
+    rc->count++;
+}
+
+
 /****************************************************************
  * Roms in CBFS
  ****************************************************************/
@@ -166,7 +380,11 @@ static struct rom_header *
 deploy_romfile(struct romfile_s *file)
 {
     u32 size = file->size;
-    struct rom_header *rom = rom_reserve(size);
+    u32 key = romcache_filekey(file);
+    struct rom_header *rom = romcache_load(key, size);
+    if (rom)
+        return rom;
+    rom = rom_reserve(size);
     if (!rom) {
         warn_noalloc();
         return NULL;
@@ -174,6 +392,7 @@ deploy_romfile(struct romfile_s *file)
     int ret = file->copy(file, rom, size);
     if (ret <= 0)
         return NULL;
+    romcache_store(key, rom, size);
     return rom;
 }
 
@@ -190,20 +409,53 @@ lookup_hardcode(struct pci_device *pci)
     return NULL;
 }
 
+// Copy a romfile started with romfile_preload() to option rom memory.
+static struct rom_header *
+deploy_preload(struct romfile_s *file, struct romfile_preload_s *preload)
+{
+    if (!preload)
+        return deploy_romfile(file);
+    int size;
+    void *data = romfile_preload_finish(preload, &size);
+    if (!data)
+        return NULL;
+    struct rom_header *rom = rom_reserve(size);
+    if (rom) {
+        memcpy(rom, data, size);
+        romcache_store(romcache_filekey(file), rom, size);
+    } else {
+        warn_noalloc();
+    }
+    free(data);
+    return rom;
+}
+
+// Start uncompressing a romfile in the background (unless it is cached).
+static struct romfile_preload_s *
+preload_romfile(struct romfile_s *file)
+{
+    if (!CONFIG_LZMA || !file
+        || romcache_find(romcache_filekey(file), file->size))
+        return NULL;
+    return romfile_preload(file);
+}
+
 // Run all roms in a given CBFS directory.
 static void
 run_file_roms(const char *prefix, int isvga, u64 *sources)
 {
-    struct romfile_s *file = NULL;
-    for (;;) {
-        file = romfile_findprefix(prefix, file);
-        if (!file)
-            break;
-        struct rom_header *rom = deploy_romfile(file);
+    struct romfile_s *file = romfile_findprefix(prefix, NULL);
+    struct romfile_preload_s *preload = preload_romfile(file);
+    while (file) {
+        struct rom_header *rom = deploy_preload(file, preload);
+        struct romfile_s *next = romfile_findprefix(prefix, file);
+        // Uncompress the next rom while this one runs its init.
+        preload = preload_romfile(next);
         if (rom) {
             setRomSource(sources, rom, (u32)file);
             init_optionrom(rom, 0, isvga);
         }
+        file = next;
     }
 }
 
@@ -308,9 +560,15 @@ map_pcirom(struct pci_device *pci)
         rom = (void*)((u32)rom + pd->ilen * 512);
     }
 
-    rom = copy_rom(rom);
+    u32 key = romcache_pcikey(pci), romsize = rom->size * 512;
+    struct rom_header *newrom = romcache_load(key, romsize);
+    if (!newrom) {
+        newrom = copy_rom(rom);
+        if (newrom)
+            romcache_store(key, newrom, romsize);
+    }
     pci_config_writel(bdf, PCI_ROM_ADDRESS, orig);
-    return rom;
+    return newrom;
 fail:
     // Not valid - restore original and exit.
     pci_config_writel(bdf, PCI_ROM_ADDRESS, orig);
@@ -436,7 +694,8 @@ vgarom_setup(void)
         init_optionrom((void*)BUILD_ROM_START, 0, 1);
     } else {
         // Clear option rom memory
-        memset((void*)BUILD_ROM_START, 0, rom_get_max() - BUILD_ROM_START);
+        smp_memset((void*)BUILD_ROM_START, 0, rom_get_max() - BUILD_ROM_START);
+        romcache_setup();
 
         // Find and deploy PCI VGA rom.
         struct pci_device *pci;
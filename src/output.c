@@ -12,6 +12,7 @@
 #include "config.h" // CONFIG_*
 #include "biosvar.h" // GET_GLOBAL
 #include "paravirt.h" // PlatformRunningOn
+#include "memmap.h" // add_e820
 
 struct putcinfo {
     void (*func)(struct putcinfo *info, char c);
@@ -39,6 +40,8 @@ debug_serial_preinit(void)
     u8 oldier, newier = 0;
     oldier = inb(CONFIG_DEBUG_SERIAL_PORT+SEROFF_IER);
     outb(newier, CONFIG_DEBUG_SERIAL_PORT+SEROFF_IER);
+    // Enable (and clear) the transmit and receive fifos
+    outb(0x07, CONFIG_DEBUG_SERIAL_PORT+SEROFF_FCR);
 
     if (oldparam != newparam || oldier != newier)
         dprintf(1, "Changing serial settings was %x/%x now %x/%x\n"
@@ -72,12 +75,10 @@ debug_serial_flush(void)
             return;
 }
 
-// Write a character to debug port(s).
+// Write a character to debug port(s) without buffering.
 static void
-putc_debug(struct putcinfo *action, char c)
+debug_putc_direct(char c)
 {
-    if (! CONFIG_DEBUG_LEVEL)
-        return;
     if (CONFIG_DEBUG_IO && runningOnQEMU())
         // Send character to debug port.
         outb(c, GET_GLOBAL(DebugOutputPort));
@@ -86,6 +87,239 @@ putc_debug(struct putcinfo *action, char c)
     debug_serial(c);
 }
 
+
+/****************************************************************
+ * Firmware log
+ ****************************************************************/
+
+// A copy of all debug output from 32bit flat mode is kept in memory
+// (in the coreboot cbmem console format) so that it can be extracted
+// after boot.
+#define FIRMWARE_LOG_SIZE (64*1024)
+#define CBMC_CURSOR_MASK ((1 << 28) - 1)
+#define CBMC_OVERFLOW (1 << 31)
+
+struct cbmem_console {
+    u32 size;
+    u32 cursor;
+    u8 body[0];
+} PACKED;
+
+struct cbmem_console *FirmwareLog VARFSEG;
+u8 FirmwareLogExport VARFSEG;
+
+// Use a log provided by the platform (eg, the coreboot cbmem console).
+void
+firmware_log_attach(void *log)
+{
+    if (!CONFIG_DEBUG_LOG)
+        return;
+    FirmwareLog = log;
+}
+
+// Allocate a log if the platform didn't provide one.
+void
+firmware_log_setup(void)
+{
+    if (!CONFIG_DEBUG_LOG || FirmwareLog)
+        return;
+    struct cbmem_console *log = memalign_tmphigh(PAGE_SIZE, FIRMWARE_LOG_SIZE);
+    if (!log) {
+        warn_noalloc();
+        return;
+    }
+    memset(log, 0, FIRMWARE_LOG_SIZE);
+    log->size = FIRMWARE_LOG_SIZE - sizeof(*log);
+    add_e820((u32)log, FIRMWARE_LOG_SIZE, E820_RESERVED);
+    FirmwareLog = log;
+    FirmwareLogExport = 1;
+}
+
+// Publish the location of an allocated log.
+void
+firmware_log_prepboot(void)
+{
+    if (!CONFIG_DEBUG_LOG || !FirmwareLogExport)
+        return;
+    dprintf(1, "Firmware log at %p\n", FirmwareLog);
+    coreboot_export_console(FirmwareLog);
+}
+
+static void
+firmware_log_write(struct cbmem_console *log, char c)
+{
+    u32 cursor = log->cursor & CBMC_CURSOR_MASK;
+    u32 flags = log->cursor & ~CBMC_CURSOR_MASK;
+    if (cursor >= log->size) {
+        cursor = 0;
+        flags |= CBMC_OVERFLOW;
+    }
+    log->body[cursor++] = c;
+    log->cursor = flags | cursor;
+}
+
+// Check if the last character written to the log ended a line.
+static int
+firmware_log_at_newline(struct cbmem_console *log)
+{
+    u32 cursor = log->cursor & CBMC_CURSOR_MASK;
+    if (cursor > log->size)
+        cursor = log->size;
+    if (cursor)
+        return log->body[cursor - 1] == '\n';
+    return !(log->cursor & CBMC_OVERFLOW) || log->body[log->size - 1] == '\n';
+}
+
+// Add a "[seconds.microseconds] " timestamp to the log.
+static void
+firmware_log_stamp(struct cbmem_console *log)
+{
+    u32 usecs = tsc_to_usec(get_tsc());
+    char buf[16];
+    char *d = &buf[sizeof(buf)];
+    int i;
+    for (i=0; i<7 || usecs; i++) {
+        if (i == 6)
+            *--d = '.';
+        *--d = (usecs % 10) + '0';
+        usecs /= 10;
+    }
+    firmware_log_write(log, '[');
+    while (d < &buf[sizeof(buf)])
+        firmware_log_write(log, *d++);
+    firmware_log_write(log, ']');
+    firmware_log_write(log, ' ');
+}
+
+static void
+firmware_log_putc(char c)
+{
+    struct cbmem_console *log = FirmwareLog;
+    if (!log)
+        return;
+    if (firmware_log_at_newline(log))
+        firmware_log_stamp(log);
+    firmware_log_write(log, c);
+}
+
+
+/****************************************************************
+ * Debug output ring
+ ****************************************************************/
+
+// The vga rom and 32bit segmented code have no access to the bios low
+// memory area.
+#if defined(VGABIOS) || (MODESEGMENT && !MODE16)
+#define DEBUG_RING 0
+#else
+#define DEBUG_RING CONFIG_DEBUG_BUFFERED
+#endif
+
+// Debug output is staged in a ring in low memory and written to the
+// debug ports in bulk.  The ring is in the reserved bios area, so its
+// last contents can also be found by the OS (via the signature).
+#define DEBUG_RING_SIGNATURE 0x52444253 // SBDR
+#define DEBUG_RING_SIZE 2048
+#define UART_FIFO_SIZE 16
+
+struct debug_ring_s {
+    u32 signature;
+    u32 size;
+    u32 head;           // Total characters written
+    u32 flushed;        // Characters sent to the debug ports
+    char data[DEBUG_RING_SIZE];
+};
+struct debug_ring_s DebugRing VARLOW = {
+    DEBUG_RING_SIGNATURE, DEBUG_RING_SIZE
+};
+
+// Send a contiguous part of the ring to the debug ports.
+static void
+debug_ring_write(u32 offset, u32 count)
+{
+    if (CONFIG_DEBUG_IO && runningOnQEMU()) {
+        SET_SEG(ES, SEG_LOW);
+        outsb(GET_GLOBAL(DebugOutputPort), (u8*)&DebugRing.data[offset], count);
+    }
+    if (!CONFIG_DEBUG_SERIAL)
+        return;
+    int fifo = 1;
+    if ((inb(CONFIG_DEBUG_SERIAL_PORT+SEROFF_IIR) & 0xc0) == 0xc0)
+        fifo = UART_FIFO_SIZE;
+    u32 i = 0, crsent = 0;
+    while (i < count) {
+        // Wait for the transmit fifo to empty and then fill it.
+        int timeout = DEBUG_TIMEOUT;
+        while ((inb(CONFIG_DEBUG_SERIAL_PORT+SEROFF_LSR) & 0x20) != 0x20)
+            if (!timeout--)
+                // Ran out of time.
+                return;
+        int space = fifo;
+        while (space && i < count) {
+            char c = GET_LOW(DebugRing.data[offset + i]);
+            if (c == '\n' && !crsent) {
+                outb('\r', CONFIG_DEBUG_SERIAL_PORT+SEROFF_DATA);
+                space--;
+                crsent = 1;
+                continue;
+            }
+            outb(c, CONFIG_DEBUG_SERIAL_PORT+SEROFF_DATA);
+            space--;
+            i++;
+            crsent = 0;
+        }
+    }
+}
+
+// Send all pending characters in the ring to the debug ports.
+static void
+debug_ring_flush(void)
+{
+    u32 pos = GET_LOW(DebugRing.flushed), head = GET_LOW(DebugRing.head);
+    while (pos != head) {
+        u32 offset = pos % DEBUG_RING_SIZE;
+        u32 count = head - pos;
+        if (count > DEBUG_RING_SIZE - offset)
+            count = DEBUG_RING_SIZE - offset;
+        debug_ring_write(offset, count);
+        pos += count;
+    }
+    SET_LOW(DebugRing.flushed, pos);
+}
+
+// Send all pending debug output.
+static void
+debug_flush(void)
+{
+    if (DEBUG_RING)
+        debug_ring_flush();
+    debug_serial_flush();
+}
+
+// Write a character to debug port(s).
+static void
+putc_debug(struct putcinfo *action, char c)
+{
+    if (! CONFIG_DEBUG_LEVEL)
+        return;
+    if (!MODESEGMENT && CONFIG_DEBUG_LOG)
+        firmware_log_putc(c);
+    if (!DEBUG_RING) {
+        debug_putc_direct(c);
+        return;
+    }
+    u32 head = GET_LOW(DebugRing.head);
+    SET_LOW(DebugRing.data[head % DEBUG_RING_SIZE], c);
+    SET_LOW(DebugRing.head, head + 1);
+    if (GET_LOW(DebugRing.head) != head + 1) {
+        // Low memory not writable (early in post) - send it directly.
+        debug_putc_direct(c);
+        return;
+    }
+    if (head + 1 - GET_LOW(DebugRing.flushed) >= DEBUG_RING_SIZE)
+        debug_ring_flush();
+}
+
 // In segmented mode just need a dummy variable (putc_debug is always
 // used anyway), and in 32bit flat mode need a pointer to the 32bit
 // instance of putc_debug().
@@ -341,7 +575,7 @@ panic(const char *fmt, ...)
         va_start(args, fmt);
         bvprintf(&debuginfo, fmt, args);
         va_end(args);
-        debug_serial_flush();
+        debug_flush();
     }
 
     // XXX - use PANIC PORT.
@@ -369,7 +603,7 @@ __dprintf(const char *fmt, ...)
     va_start(args, fmt);
     bvprintf(&debuginfo, fmt, args);
     va_end(args);
-    debug_serial_flush();
+    debug_flush();
 }
 
 void
@@ -381,7 +615,7 @@ printf(const char *fmt, ...)
     bvprintf(&screeninfo, fmt, args);
     va_end(args);
     if (ScreenAndDebug)
-        debug_serial_flush();
+        debug_flush();
 }
 
 
@@ -472,7 +706,7 @@ hexdump(const void *d, int len)
         d+=4;
     }
     putc(&debuginfo, '\n');
-    debug_serial_flush();
+    debug_flush();
 }
 
 static void
@@ -496,7 +730,7 @@ __debug_isr(const char *fname)
 {
     puts_cs(&debuginfo, fname);
     putc(&debuginfo, '\n');
-    debug_serial_flush();
+    debug_flush();
 }
 
 // Function called on handler startup.
@@ -130,6 +130,7 @@ qemu_platform_setup(void)
 #define QEMU_CFG_SIGNATURE              0x00
 #define QEMU_CFG_ID                     0x01
 #define QEMU_CFG_UUID                   0x02
+#define QEMU_CFG_NB_CPUS                0x05
 #define QEMU_CFG_NUMA                   0x0d
 #define QEMU_CFG_BOOT_MENU              0x0e
 #define QEMU_CFG_MAX_CPUS               0x0f
@@ -187,7 +188,7 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
 static void
 qemu_romfile_add(char *name, int select, int skip, int size)
 {
-    struct qemu_romfile_s *qfile = malloc_tmp(sizeof(*qfile));
+    struct qemu_romfile_s *qfile = malloc_arena(sizeof(*qfile));
     if (!qfile) {
         warn_noalloc();
         return;
@@ -229,6 +230,7 @@ qemu_cfg_legacy(void)
     qemu_romfile_add("etc/show-boot-menu", QEMU_CFG_BOOT_MENU, 0, 2);
     qemu_romfile_add("etc/irq0-override", QEMU_CFG_IRQ0_OVERRIDE, 0, 1);
     qemu_romfile_add("etc/max-cpus", QEMU_CFG_MAX_CPUS, 0, 2);
+    qemu_romfile_add("etc/boot-cpus", QEMU_CFG_NB_CPUS, 0, 2);
 
     // NUMA data
     u64 numacount;
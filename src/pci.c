@@ -13,42 +13,102 @@
 #include "pci_regs.h" // PCI_VENDOR_ID
 #include "pci_ids.h" // PCI_CLASS_DISPLAY_VGA
 
+// Base of the memory mapped (ECAM) config space window.  It is only
+// used from 32bit flat mode during POST - port io is used otherwise.
+u32 PCIMmconfigBase VARFSEG;
+
+// Number of config space accesses made during POST.
+u32 PCIConfigAccesses VARFSEG;
+
+static inline void *
+pci_mmconfig_addr(u16 bdf, u32 addr)
+{
+    if (MODESEGMENT)
+        return NULL;
+    PCIConfigAccesses++;
+    if (!PCIMmconfigBase)
+        return NULL;
+    return (void*)PCIMmconfigBase + (bdf << 12) + (addr & 0xfff);
+}
+
 void pci_config_writel(u16 bdf, u32 addr, u32 val)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg) {
+        writel(mmcfg, val);
+        return;
+    }
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     outl(val, PORT_PCI_DATA);
 }
 
 void pci_config_writew(u16 bdf, u32 addr, u16 val)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg) {
+        writew(mmcfg, val);
+        return;
+    }
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     outw(val, PORT_PCI_DATA + (addr & 2));
 }
 
 void pci_config_writeb(u16 bdf, u32 addr, u8 val)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg) {
+        writeb(mmcfg, val);
+        return;
+    }
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     outb(val, PORT_PCI_DATA + (addr & 3));
 }
 
 u32 pci_config_readl(u16 bdf, u32 addr)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg)
+        return readl(mmcfg);
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     return inl(PORT_PCI_DATA);
 }
 
 u16 pci_config_readw(u16 bdf, u32 addr)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg)
+        return readw(mmcfg);
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     return inw(PORT_PCI_DATA + (addr & 2));
 }
 
 u8 pci_config_readb(u16 bdf, u32 addr)
 {
+    void *mmcfg = pci_mmconfig_addr(bdf, addr);
+    if (mmcfg)
+        return readb(mmcfg);
     outl(0x80000000 | (bdf << 8) | (addr & 0xfc), PORT_PCI_CMD);
     return inb(PORT_PCI_DATA + (addr & 3));
 }
 
+// Start using memory mapped config space access.
+void
+pci_enable_mmconfig(u64 addr, const char *name)
+{
+    if (addr >= 0x100000000ULL)
+        return;
+    dprintf(1, "PCIe: using %s mmconfig at 0x%x\n", name, (u32)addr);
+    PCIMmconfigBase = addr;
+}
+
+// Revert to port io (the chipset mmconfig setting isn't retained
+// across an S3 resume).
+void
+pci_prepboot(void)
+{
+    PCIMmconfigBase = 0;
+}
+
 void
 pci_config_maskw(u16 bdf, u32 addr, u16 off, u16 on)
 {
@@ -100,73 +160,171 @@ pci_probe_host(void)
     return 0;
 }
 
+// Devices by class and by vendor/device id.  Each bucket is kept in
+// PCIDevices order (the tail of each bucket is tracked for appending).
+#define PCI_INDEX_HASH_SIZE 16
+
+static struct hlist_head PCIClassHash[PCI_INDEX_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_head PCIIdHash[PCI_INDEX_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_node **PCIClassTail[PCI_INDEX_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_node **PCIIdTail[PCI_INDEX_HASH_SIZE] VARVERIFY32INIT;
+
+static inline u32
+pci_hash(u32 val)
+{
+    return (val * 0x9e370001) >> 28;
+}
+
+// Return the list of devices that may match the given class.
+struct hlist_head *
+pci_class_list(u16 classid)
+{
+    return &PCIClassHash[pci_hash(classid)];
+}
+
+// Return the list of devices that may match the given vendor/device.
+struct hlist_head *
+pci_id_list(u16 vendid, u16 devid)
+{
+    return &PCIIdHash[pci_hash((devid << 16) | vendid)];
+}
+
+// Append a node to a hash bucket.
+static void
+pci_index_append(struct hlist_node *n, struct hlist_head *h
+                 , struct hlist_node ***tail)
+{
+    if (!*tail)
+        *tail = &h->first;
+    hlist_add(n, *tail);
+    *tail = &n->next;
+}
+
+// Add a newly probed device to the index.
+static void
+pci_index_add(struct pci_device *dev)
+{
+    u32 hash = pci_hash(dev->class);
+    pci_index_append(&dev->classnode, &PCIClassHash[hash]
+                     , &PCIClassTail[hash]);
+    hash = pci_hash((dev->device << 16) | dev->vendor);
+    pci_index_append(&dev->idnode, &PCIIdHash[hash], &PCIIdTail[hash]);
+}
+
+// Scan a single bus and add its devices to the PCIDevices list.  The
+// bus is only scanned if it is a root bus or the secondary bus of a
+// bridge found earlier (busdevs[bus] set).
+static int
+pci_probe_bus(int bus, struct pci_device **busdevs, u8 *bridged
+              , struct hlist_node ***pprev, int *rootbuses)
+{
+    int bdf, count = 0;
+    foreachbdf(bdf, bus) {
+        // Create new pci_device struct and add to list.
+        struct pci_device *dev = malloc_arena(sizeof(*dev));
+        if (!dev) {
+            warn_noalloc();
+            return -1;
+        }
+        memset(dev, 0, sizeof(*dev));
+        hlist_add(&dev->node, *pprev);
+        *pprev = &dev->node.next;
+
+        // Find parent device.
+        int rootbus;
+        struct pci_device *parent = busdevs[bus];
+        if (!parent) {
+            if (!count)
+                (*rootbuses)++;
+            rootbus = *rootbuses - 1;
+            if (bus > MaxPCIBus)
+                MaxPCIBus = bus;
+        } else {
+            rootbus = parent->rootbus;
+        }
+        count++;
+
+        // Populate pci_device info.
+        dev->bdf = bdf;
+        dev->parent = parent;
+        dev->rootbus = rootbus;
+        u32 vendev = pci_config_readl(bdf, PCI_VENDOR_ID);
+        dev->vendor = vendev & 0xffff;
+        dev->device = vendev >> 16;
+        u32 classrev = pci_config_readl(bdf, PCI_CLASS_REVISION);
+        dev->class = classrev >> 16;
+        dev->prog_if = classrev >> 8;
+        dev->revision = classrev & 0xff;
+        dev->header_type = pci_config_readb(bdf, PCI_HEADER_TYPE);
+        pci_index_add(dev);
+        u8 v = dev->header_type & 0x7f;
+        if (v == PCI_HEADER_TYPE_BRIDGE || v == PCI_HEADER_TYPE_CARDBUS) {
+            u8 secbus = pci_config_readb(bdf, PCI_SECONDARY_BUS);
+            u8 subbus = pci_config_readb(bdf, PCI_SUBORDINATE_BUS);
+            dev->secondary_bus = secbus;
+            if (secbus > bus && !busdevs[secbus]) {
+                busdevs[secbus] = dev;
+                // Buses behind the bridge are only reachable through it.
+                int i;
+                for (i=secbus; i<=subbus && i<256; i++)
+                    bridged[i] = 1;
+            }
+            if (secbus > MaxPCIBus)
+                MaxPCIBus = secbus;
+        }
+        dprintf(4, "PCI device %02x:%02x.%x (vd=%04x:%04x c=%04x)\n"
+                , pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf)
+                , pci_bdf_to_fn(bdf)
+                , dev->vendor, dev->device, dev->class);
+    }
+    return count;
+}
+
 // Find all PCI devices and populate PCIDevices linked list.
 void
 pci_probe_devices(void)
 {
     dprintf(3, "PCI probe\n");
+    u32 accesses = PCIConfigAccesses;
     struct pci_device *busdevs[256];
+    u8 bridged[256], roots[256];
     memset(busdevs, 0, sizeof(busdevs));
+    memset(bridged, 0, sizeof(bridged));
+    memset(roots, 0, sizeof(roots));
     struct hlist_node **pprev = &PCIDevices.first;
+
+    // Bus 0 is always a root bus.  The location of any additional host
+    // bridges is taken from "etc/pci-root-buses" (one byte per bus) if
+    // available - otherwise empty buses have to be probed for them.
+    roots[0] = 1;
     int extraroots = romfile_loadint("etc/extra-pci-roots", 0);
-    int bus = -1, lastbus = 0, rootbuses = 0, count=0;
-    while (bus < 0xff && (bus < MaxPCIBus || rootbuses < extraroots)) {
-        bus++;
-        int bdf;
-        foreachbdf(bdf, bus) {
-            // Create new pci_device struct and add to list.
-            struct pci_device *dev = malloc_tmp(sizeof(*dev));
-            if (!dev) {
-                warn_noalloc();
-                return;
-            }
-            memset(dev, 0, sizeof(*dev));
-            hlist_add(&dev->node, pprev);
-            pprev = &dev->node.next;
-            count++;
-
-            // Find parent device.
-            int rootbus;
-            struct pci_device *parent = busdevs[bus];
-            if (!parent) {
-                if (bus != lastbus)
-                    rootbuses++;
-                lastbus = bus;
-                rootbus = rootbuses;
-                if (bus > MaxPCIBus)
-                    MaxPCIBus = bus;
-            } else {
-                rootbus = parent->rootbus;
-            }
+    int rootlistsize, i;
+    u8 *rootlist = romfile_loadfile("etc/pci-root-buses", &rootlistsize);
+    int haveroots = !!rootlist;
+    if (rootlist) {
+        for (i=0; i<rootlistsize; i++)
+            roots[rootlist[i]] = 1;
+        free(rootlist);
+    }
 
-            // Populate pci_device info.
-            dev->bdf = bdf;
-            dev->parent = parent;
-            dev->rootbus = rootbus;
-            u32 vendev = pci_config_readl(bdf, PCI_VENDOR_ID);
-            dev->vendor = vendev & 0xffff;
-            dev->device = vendev >> 16;
-            u32 classrev = pci_config_readl(bdf, PCI_CLASS_REVISION);
-            dev->class = classrev >> 16;
-            dev->prog_if = classrev >> 8;
-            dev->revision = classrev & 0xff;
-            dev->header_type = pci_config_readb(bdf, PCI_HEADER_TYPE);
-            u8 v = dev->header_type & 0x7f;
-            if (v == PCI_HEADER_TYPE_BRIDGE || v == PCI_HEADER_TYPE_CARDBUS) {
-                u8 secbus = pci_config_readb(bdf, PCI_SECONDARY_BUS);
-                dev->secondary_bus = secbus;
-                if (secbus > bus && !busdevs[secbus])
-                    busdevs[secbus] = dev;
-                if (secbus > MaxPCIBus)
-                    MaxPCIBus = secbus;
-            }
-            dprintf(4, "PCI device %02x:%02x.%x (vd=%04x:%04x c=%04x)\n"
-                    , pci_bdf_to_bus(bdf), pci_bdf_to_dev(bdf)
-                    , pci_bdf_to_fn(bdf)
-                    , dev->vendor, dev->device, dev->class);
+    int bus, rootbuses = 0, count = 0;
+    for (bus=0; bus<256; bus++) {
+        if (!roots[bus] && !busdevs[bus]) {
+            // Without a root list, look for unlisted root buses up to
+            // MaxPCIBus (and beyond while some are still missing), but
+            // never inside a bridge's secondary..subordinate range.
+            if (haveroots || bridged[bus]
+                || (bus > MaxPCIBus && rootbuses > extraroots))
+                continue;
         }
+        int ret = pci_probe_bus(bus, busdevs, bridged, &pprev, &rootbuses);
+        if (ret < 0)
+            return;
+        count += ret;
     }
     dprintf(1, "Found %d PCI devices (max PCI bus is %02x)\n", count, MaxPCIBus);
+    dprintf(3, "PCI probe used %d config space accesses\n"
+            , PCIConfigAccesses - accesses);
 }
 
 // Search for a device with the specified vendor and device ids.
@@ -174,7 +332,7 @@ struct pci_device *
 pci_find_device(u16 vendid, u16 devid)
 {
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_id(pci, vendid, devid) {
         if (pci->vendor == vendid && pci->device == devid)
             return pci;
     }
@@ -186,7 +344,7 @@ struct pci_device *
 pci_find_class(u16 classid)
 {
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_class(pci, classid) {
         if (pci->class == classid)
             return pci;
     }
@@ -209,6 +367,9 @@ int pci_init_device(const struct pci_device_id *ids
     return -1;
 }
 
+// Find and init the first device matching 'ids'.  The id tables may
+// use PCI_ANY_ID for the vendor, device, or class, so a table can't be
+// mapped to a single hash bucket - the full device list is walked.
 struct pci_device *
 pci_find_init_device(const struct pci_device_id *ids, void *arg)
 {
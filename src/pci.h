@@ -37,6 +37,8 @@ u32 pci_config_readl(u16 bdf, u32 addr);
 u16 pci_config_readw(u16 bdf, u32 addr);
 u8 pci_config_readb(u16 bdf, u32 addr);
 void pci_config_maskw(u16 bdf, u32 addr, u16 off, u16 on);
+void pci_enable_mmconfig(u64 addr, const char *name);
+void pci_prepboot(void);
 
 struct pci_device *pci_find_device(u16 vendid, u16 devid);
 struct pci_device *pci_find_class(u16 classid);
@@ -45,6 +47,7 @@ struct pci_device {
     u16 bdf;
     u8 rootbus;
     struct hlist_node node;
+    struct hlist_node classnode, idnode;
     struct pci_device *parent;
 
     // Configuration space device information
@@ -70,6 +73,15 @@ static inline u32 pci_classprog(struct pci_device *pci) {
 #define foreachpci(PCI)                                 \
     hlist_for_each_entry(PCI, &PCIDevices, node)
 
+// Iterate over the devices that may match a class or vendor/device
+// id - callers must still check the device fields.
+struct hlist_head *pci_class_list(u16 classid);
+struct hlist_head *pci_id_list(u16 vendid, u16 devid);
+#define foreachpci_class(PCI, CLASSID)                                  \
+    hlist_for_each_entry(PCI, pci_class_list(CLASSID), classnode)
+#define foreachpci_id(PCI, VENDID, DEVID)                               \
+    hlist_for_each_entry(PCI, pci_id_list((VENDID), (DEVID)), idnode)
+
 int pci_next(int bdf, int bus);
 #define foreachbdf(BDF, BUS)                                    \
     for (BDF=pci_next(pci_bus_devfn_to_bdf((BUS), 0)-1, (BUS))  \
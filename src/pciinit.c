@@ -386,6 +386,7 @@ void mch_mem_addr_setup(struct pci_device *dev, void *arg)
     pci_config_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR + 4, upper);
     pci_config_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR, lower);
     add_e820(addr, size, E820_RESERVED);
+    pci_enable_mmconfig(addr, "q35");
 
     /* setup pci i/o window (above mmconfig) */
     pcimem_start = addr + size;
@@ -571,17 +572,32 @@ static u64 pci_region_sum(struct pci_region *r)
     return sum;
 }
 
+// Insert an entry into a region list - largest alignment first, so
+// that the entries can be packed without any gaps between them.
+static void
+pci_region_insert_entry(struct pci_region *r, struct pci_region_entry *entry)
+{
+    struct hlist_node **pprev;
+    struct pci_region_entry *pos;
+    hlist_for_each_entry_pprev(pos, pprev, &r->list, node) {
+        if (pos->align < entry->align
+            || (pos->align == entry->align && pos->size < entry->size))
+            break;
+    }
+    hlist_add(&entry->node, pprev);
+}
+
 static void pci_region_migrate_64bit_entries(struct pci_region *from,
                                              struct pci_region *to)
 {
-    struct hlist_node *n, **last = &to->list.first;
+    struct hlist_node *n;
     struct pci_region_entry *entry;
     hlist_for_each_entry_safe(entry, n, &from->list, node) {
         if (!entry->is64)
             continue;
         // Move from source list to destination list.
         hlist_del(&entry->node);
-        hlist_add(&entry->node, last);
+        pci_region_insert_entry(to, entry);
     }
 }
 
@@ -601,14 +617,7 @@ pci_region_create_entry(struct pci_bus *bus, struct pci_device *dev,
     entry->align = align;
     entry->is64 = is64;
     entry->type = type;
-    // Insert into list in sorted order.
-    struct hlist_node **pprev;
-    struct pci_region_entry *pos;
-    hlist_for_each_entry_pprev(pos, pprev, &bus->r[type].list, node) {
-        if (pos->align < align || (pos->align == align && pos->size < size))
-            break;
-    }
-    hlist_add(&entry->node, pprev);
+    pci_region_insert_entry(&bus->r[type], entry);
     return entry;
 }
 
@@ -761,20 +770,65 @@ static void pci_region_map_entries(struct pci_bus *busses, struct pci_region *r)
     }
 }
 
+// Report the space used by a root region and the padding lost to
+// alignment between the region and the top of its window.
+static void
+pci_region_report(const char *name, struct pci_region *r, u64 end)
+{
+    u64 sum = pci_region_sum(r);
+    if (!sum)
+        return;
+    int count = 0;
+    struct pci_region_entry *entry;
+    hlist_for_each_entry(entry, &r->list, node) {
+        count++;
+    }
+    dprintf(1, "PCI: %-8s %08llx-%08llx %4d entries, %lld KiB used"
+            ", %lld KiB align padding\n"
+            , name, r->base, r->base + sum - 1, count, sum >> 10
+            , (end - (r->base + sum)) >> 10);
+}
+
 static void pci_bios_map_devices(struct pci_bus *busses)
 {
+    struct pci_region r64_mem, r64_pref;
+    r64_mem.list.first = NULL;
+    r64_pref.list.first = NULL;
+    struct pci_region *r_mem = &busses[0].r[PCI_REGION_TYPE_MEM];
+    struct pci_region *r_pref = &busses[0].r[PCI_REGION_TYPE_PREFMEM];
+
+    if (CONFIG_PCI_HIGH_PREFMEM)
+        // Keep the 32bit window for bars that can't be mapped above 4G.
+        pci_region_migrate_64bit_entries(r_pref, &r64_pref);
+
     if (pci_bios_init_root_regions(busses)) {
-        struct pci_region r64_mem, r64_pref;
-        r64_mem.list.first = NULL;
-        r64_pref.list.first = NULL;
-        pci_region_migrate_64bit_entries(&busses[0].r[PCI_REGION_TYPE_MEM],
-                                         &r64_mem);
-        pci_region_migrate_64bit_entries(&busses[0].r[PCI_REGION_TYPE_PREFMEM],
-                                         &r64_pref);
+        pci_region_migrate_64bit_entries(r_mem, &r64_mem);
+        pci_region_migrate_64bit_entries(r_pref, &r64_pref);
 
         if (pci_bios_init_root_regions(busses))
             panic("PCI: out of 32bit address space\n");
+    }
 
+    // Report 32bit window usage - the mem and prefmem regions are
+    // placed top down, so only the lower one can have padding above it.
+    u64 mem_end = pcimem_end, pref_end = pcimem_end;
+    if (pci_region_sum(r_pref) && r_pref->base > r_mem->base)
+        mem_end = r_pref->base;
+    else if (pci_region_sum(r_mem) && r_mem->base > r_pref->base)
+        pref_end = r_mem->base;
+    u64 low = r_mem->base < r_pref->base ? r_mem->base : r_pref->base;
+    struct pci_region *r_io = &busses[0].r[PCI_REGION_TYPE_IO];
+    dprintf(1, "PCI: 32bit window %08llx-%08llx, %lld KiB free\n"
+            , pcimem_start, pcimem_end - 1, (low - pcimem_start) >> 10);
+    pci_region_report("io", r_io, r_io->base + pci_region_sum(r_io));
+    pci_region_report("mem", r_mem, mem_end);
+    pci_region_report("prefmem", r_pref, pref_end);
+
+    if (hlist_empty(&r64_mem.list) && hlist_empty(&r64_pref.list)) {
+        // no bars mapped high -> drop 64bit window (see dsdt)
+        pcimem64_start = 0;
+    } else {
+        // The 64bit window starts above the highest ram address.
         u64 sum_mem = pci_region_sum(&r64_mem);
         u64 sum_pref = pci_region_sum(&r64_pref);
         u64 align_mem = pci_region_align(&r64_mem);
@@ -785,11 +839,13 @@ static void pci_bios_map_devices(struct pci_bus *busses)
         pcimem64_start = r64_mem.base;
         pcimem64_end = r64_pref.base + sum_pref;
 
+        dprintf(1, "PCI: 64bit window %08llx-%08llx\n"
+                , pcimem64_start, pcimem64_end - 1);
+        pci_region_report("mem64", &r64_mem, r64_pref.base);
+        pci_region_report("prefmem64", &r64_pref, pcimem64_end);
+
         pci_region_map_entries(busses, &r64_mem);
         pci_region_map_entries(busses, &r64_pref);
-    } else {
-        // no bars mapped high -> drop 64bit window (see dsdt)
-        pcimem64_start = 0;
     }
     // Map regions on each device.
     int bus;
@@ -15,6 +15,7 @@
 // Information on a reserved area.
 struct allocinfo_s {
     struct hlist_node node;
+    struct hlist_node freenode;
     void *data, *dataend, *allocend;
 };
 
@@ -22,12 +23,19 @@ struct allocinfo_s {
 struct allocdetail_s {
     struct allocinfo_s detailinfo;
     struct allocinfo_s datainfo;
+    struct hlist_node hashnode, handlenode;
     u32 handle;
+    u8 zoneid, detailzoneid;
 };
 
-// The various memory zones.
+// The various memory zones.  Areas with free space after them are also
+// kept on a list selected by the log2 of that space.
+#define ZONE_FREE_LISTS 32
+
 struct zone_s {
     struct hlist_head head;
+    struct hlist_head free[ZONE_FREE_LISTS];
+    u32 used, peak;
 };
 
 struct zone_s ZoneLow VARVERIFY32INIT, ZoneHigh VARVERIFY32INIT;
@@ -37,32 +45,90 @@ struct zone_s ZoneTmpLow VARVERIFY32INIT, ZoneTmpHigh VARVERIFY32INIT;
 static struct zone_s *Zones[] VARVERIFY32INIT = {
     &ZoneTmpLow, &ZoneLow, &ZoneFSeg, &ZoneTmpHigh, &ZoneHigh
 };
+static const char *ZoneNames[] VARVERIFY32INIT = {
+    "tmplow", "low", "fseg", "tmphigh", "high"
+};
+
+// Tracked allocations by data address and by pmm handle.
+#define ALLOC_HASH_SIZE 256
+#define HANDLE_HASH_SIZE 16
+
+static struct hlist_head AllocHash[ALLOC_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_head HandleHash[HANDLE_HASH_SIZE] VARVERIFY32INIT;
+
+static inline u32
+hash32(u32 val)
+{
+    return val * 0x9e370001;
+}
+
+static struct hlist_head *
+allocHashHead(void *data)
+{
+    return &AllocHash[hash32((u32)data) >> 24];
+}
+
+static struct hlist_head *
+handleHashHead(u32 handle)
+{
+    return &HandleHash[hash32(handle) >> 28];
+}
+
+static int
+getZoneId(struct zone_s *zone)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++)
+        if (Zones[i] == zone)
+            return i;
+    return 0;
+}
 
 
 /****************************************************************
  * low-level memory reservations
  ****************************************************************/
 
+// Place an area on the free list that matches its trailing space.
+static void
+updateFree(struct zone_s *zone, struct allocinfo_s *info)
+{
+    if (info->freenode.pprev)
+        hlist_del(&info->freenode);
+    info->freenode.pprev = NULL;
+    u32 space = info->allocend - info->dataend;
+    if (space < MALLOC_MIN_ALIGN)
+        return;
+    hlist_add_head(&info->freenode, &zone->free[__fls(space)]);
+}
+
 // Find and reserve space from a given zone
 static void *
 allocSpace(struct zone_s *zone, u32 size, u32 align, struct allocinfo_s *fill)
 {
-    struct allocinfo_s *info;
-    hlist_for_each_entry(info, &zone->head, node) {
-        void *dataend = info->dataend;
-        void *allocend = info->allocend;
-        void *newallocend = (void*)ALIGN_DOWN((u32)allocend - size, align);
-        if (newallocend >= dataend && newallocend <= allocend) {
-            // Found space - now reserve it.
-            if (!fill)
-                fill = newallocend;
-            fill->data = newallocend;
-            fill->dataend = newallocend + size;
-            fill->allocend = allocend;
-
-            info->allocend = newallocend;
-            hlist_add_before(&fill->node, &info->node);
-            return newallocend;
+    // Only lists with at least 'size' bytes of space need to be checked.
+    int i;
+    for (i=__fls(size); i<ZONE_FREE_LISTS; i++) {
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &zone->free[i], freenode) {
+            void *dataend = info->dataend;
+            void *allocend = info->allocend;
+            void *newallocend = (void*)ALIGN_DOWN((u32)allocend - size, align);
+            if (newallocend >= dataend && newallocend <= allocend) {
+                // Found space - now reserve it.
+                if (!fill)
+                    fill = newallocend;
+                fill->data = newallocend;
+                fill->dataend = newallocend + size;
+                fill->allocend = allocend;
+                fill->freenode.pprev = NULL;
+
+                info->allocend = newallocend;
+                hlist_add_before(&fill->node, &info->node);
+                updateFree(zone, info);
+                updateFree(zone, fill);
+                return newallocend;
+            }
         }
     }
     return NULL;
@@ -70,13 +136,39 @@ allocSpace(struct zone_s *zone, u32 size, u32 align, struct allocinfo_s *fill)
 
 // Release space allocated with allocSpace()
 static void
-freeSpace(struct allocinfo_s *info)
+freeSpace(struct zone_s *zone, struct allocinfo_s *info)
 {
     struct allocinfo_s *next = container_of_or_null(
         info->node.next, struct allocinfo_s, node);
-    if (next && next->allocend == info->data)
+    if (next && next->allocend == info->data) {
         next->allocend = info->allocend;
+        updateFree(zone, next);
+    }
     hlist_del(&info->node);
+    if (info->freenode.pprev)
+        hlist_del(&info->freenode);
+}
+
+// Reserve space for the bookkeeping of an allocation.
+static struct allocdetail_s *
+allocDetail(void)
+{
+    struct allocdetail_s *detail = allocSpace(
+        &ZoneTmpHigh, sizeof(*detail), MALLOC_MIN_ALIGN, NULL);
+    if (detail) {
+        detail->detailzoneid = getZoneId(&ZoneTmpHigh);
+        return detail;
+    }
+    detail = allocSpace(&ZoneTmpLow, sizeof(*detail), MALLOC_MIN_ALIGN, NULL);
+    if (detail)
+        detail->detailzoneid = getZoneId(&ZoneTmpLow);
+    return detail;
+}
+
+static void
+freeDetail(struct allocdetail_s *detail)
+{
+    freeSpace(Zones[detail->detailzoneid], &detail->detailinfo);
 }
 
 // Add new memory to a zone
@@ -95,40 +187,41 @@ addSpace(struct zone_s *zone, void *start, void *end)
     struct allocdetail_s tempdetail;
     tempdetail.datainfo.data = tempdetail.datainfo.dataend = start;
     tempdetail.datainfo.allocend = end;
+    tempdetail.datainfo.freenode.pprev = NULL;
     hlist_add(&tempdetail.datainfo.node, pprev);
+    updateFree(zone, &tempdetail.datainfo);
 
     // Allocate final allocation info.
-    struct allocdetail_s *detail = allocSpace(
-        &ZoneTmpHigh, sizeof(*detail), MALLOC_MIN_ALIGN, NULL);
+    struct allocdetail_s *detail = allocDetail();
     if (!detail) {
-        detail = allocSpace(&ZoneTmpLow, sizeof(*detail)
-                            , MALLOC_MIN_ALIGN, NULL);
-        if (!detail) {
-            hlist_del(&tempdetail.datainfo.node);
-            warn_noalloc();
-            return;
-        }
+        hlist_del(&tempdetail.datainfo.node);
+        if (tempdetail.datainfo.freenode.pprev)
+            hlist_del(&tempdetail.datainfo.freenode);
+        warn_noalloc();
+        return;
     }
 
     // Replace temp alloc space with final alloc space
     pprev = tempdetail.datainfo.node.pprev;
     hlist_del(&tempdetail.datainfo.node);
+    if (tempdetail.datainfo.freenode.pprev)
+        hlist_del(&tempdetail.datainfo.freenode);
     memcpy(&detail->datainfo, &tempdetail.datainfo, sizeof(detail->datainfo));
+    detail->datainfo.freenode.pprev = NULL;
     detail->handle = PMM_DEFAULT_HANDLE;
+    detail->zoneid = getZoneId(zone);
     hlist_add(&detail->datainfo.node, pprev);
+    updateFree(zone, &detail->datainfo);
 }
 
-// Search all zones for an allocation obtained from allocSpace()
-static struct allocinfo_s *
+// Find a tracked allocation from its data address
+static struct allocdetail_s *
 findAlloc(void *data)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->data == data)
-                return info;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, allocHashHead(data), hashnode) {
+        if (detail->datainfo.data == data)
+            return detail;
     }
     return NULL;
 }
@@ -158,19 +251,14 @@ pmm_malloc(struct zone_s *zone, u32 handle, u32 size, u32 align)
         return NULL;
 
     // Find and reserve space for bookkeeping.
-    struct allocdetail_s *detail = allocSpace(
-        &ZoneTmpHigh, sizeof(*detail), MALLOC_MIN_ALIGN, NULL);
-    if (!detail) {
-        detail = allocSpace(&ZoneTmpLow, sizeof(*detail)
-                            , MALLOC_MIN_ALIGN, NULL);
-        if (!detail)
-            return NULL;
-    }
+    struct allocdetail_s *detail = allocDetail();
+    if (!detail)
+        return NULL;
 
     // Find and reserve space for main allocation
     void *data = allocSpace(zone, size, align, &detail->datainfo);
     if (!data) {
-        freeSpace(&detail->detailinfo);
+        freeDetail(detail);
         return NULL;
     }
 
@@ -179,6 +267,13 @@ pmm_malloc(struct zone_s *zone, u32 handle, u32 size, u32 align)
             , zone, handle, size, align
             , data, detail);
     detail->handle = handle;
+    detail->zoneid = getZoneId(zone);
+    hlist_add_head(&detail->hashnode, allocHashHead(data));
+    if (handle != PMM_DEFAULT_HANDLE)
+        hlist_add_head(&detail->handlenode, handleHashHead(handle));
+    zone->used += size;
+    if (zone->used > zone->peak)
+        zone->peak = zone->used;
 
     return data;
 }
@@ -188,14 +283,17 @@ int
 pmm_free(void *data)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = findAlloc(data);
-    if (!info || data == (void*)info || data == info->dataend)
+    struct allocdetail_s *detail = findAlloc(data);
+    if (!detail)
         return -1;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
     dprintf(8, "pmm_free %p (detail=%p)\n", data, detail);
-    freeSpace(info);
-    freeSpace(&detail->detailinfo);
+    struct zone_s *zone = Zones[detail->zoneid];
+    zone->used -= detail->datainfo.dataend - detail->datainfo.data;
+    hlist_del(&detail->hashnode);
+    if (detail->handle != PMM_DEFAULT_HANDLE)
+        hlist_del(&detail->handlenode);
+    freeSpace(zone, &detail->datainfo);
+    freeDetail(detail);
     return 0;
 }
 
@@ -206,11 +304,14 @@ pmm_getspace(struct zone_s *zone)
     // XXX - doesn't account for ZoneLow being able to grow.
     // XXX - results not reliable when CONFIG_THREAD_OPTIONROMS
     u32 maxspace = 0;
-    struct allocinfo_s *info;
-    hlist_for_each_entry(info, &zone->head, node) {
-        u32 space = info->allocend - info->dataend;
-        if (space > maxspace)
-            maxspace = space;
+    int i;
+    for (i=ZONE_FREE_LISTS-1; i>=0 && !maxspace; i--) {
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &zone->free[i], freenode) {
+            u32 space = info->allocend - info->dataend;
+            if (space > maxspace)
+                maxspace = space;
+        }
     }
 
     if (zone != &ZoneTmpHigh && zone != &ZoneTmpLow)
@@ -226,22 +327,79 @@ pmm_getspace(struct zone_s *zone)
 static void *
 pmm_find(u32 handle)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->data != (void*)info)
-                continue;
-            struct allocdetail_s *detail = container_of(
-                info, struct allocdetail_s, detailinfo);
-            if (detail->handle == handle)
-                return detail->datainfo.data;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, handleHashHead(handle), handlenode) {
+        if (detail->handle == handle)
+            return detail->datainfo.data;
     }
     return NULL;
 }
 
 
+/****************************************************************
+ * POST arena
+ ****************************************************************/
+
+// Small objects that are only needed during POST are carved out of
+// large temporary chunks without any per-object bookkeeping.  They
+// are all released at once in malloc_prepboot().
+#define ARENA_CHUNK_SIZE (16*1024)
+#define ARENA_ALIGN 8
+
+struct arena_chunk_s {
+    struct arena_chunk_s *next;
+    u32 size;
+};
+
+static struct arena_chunk_s *ArenaChunks VARVERIFY32INIT;
+static void *ArenaPos VARVERIFY32INIT, *ArenaEnd VARVERIFY32INIT;
+static u32 ArenaUsed VARVERIFY32INIT;
+
+// Allocate memory that remains valid until the end of POST.
+void * __malloc
+malloc_arena(u32 size)
+{
+    ASSERT32FLAT();
+    size = ALIGN(size, ARENA_ALIGN);
+    if (size > ArenaEnd - ArenaPos) {
+        u32 hdr = ALIGN(sizeof(struct arena_chunk_s), ARENA_ALIGN);
+        u32 chunksize = ARENA_CHUNK_SIZE;
+        if (size + hdr > chunksize)
+            chunksize = size + hdr;
+        struct arena_chunk_s *chunk = malloc_tmp(chunksize);
+        if (!chunk)
+            return NULL;
+        chunk->next = ArenaChunks;
+        chunk->size = chunksize;
+        ArenaChunks = chunk;
+        ArenaPos = (void*)chunk + hdr;
+        ArenaEnd = (void*)chunk + chunksize;
+    }
+    void *data = ArenaPos;
+    ArenaPos += size;
+    ArenaUsed += size;
+    return data;
+}
+
+// Release all arena memory.
+static void
+arena_free_all(void)
+{
+    u32 count = 0, space = 0;
+    while (ArenaChunks) {
+        struct arena_chunk_s *chunk = ArenaChunks;
+        ArenaChunks = chunk->next;
+        count++;
+        space += chunk->size;
+        free(chunk);
+    }
+    dprintf(1, "arena: used=%d in %d chunks (%d bytes)\n"
+            , ArenaUsed, count, space);
+    ArenaPos = ArenaEnd = NULL;
+    ArenaUsed = 0;
+}
+
+
 /****************************************************************
  * 0xc0000-0xf0000 management
  ****************************************************************/
@@ -276,6 +434,7 @@ rom_reserve(u32 size)
     if (newend < (u32)zonelow_base + OPROM_HEADER_RESERVE)
         newend = (u32)zonelow_base + OPROM_HEADER_RESERVE;
     RomBase->data = RomBase->dataend = (void*)newend;
+    updateFree(&ZoneLow, RomBase);
     return (void*)RomEnd;
 }
 
@@ -310,7 +469,9 @@ malloc_preinit(void)
     add_e820(BUILD_BIOS_ADDR, BUILD_BIOS_SIZE, E820_RESERVED);
 
     // Populate temp high ram
-    u32 highram = 0;
+    u32 highram = 0, highsize = BUILD_MAX_HIGHTABLE;
+    if (CONFIG_OPTIONROMS_CACHE)
+        highsize += BUILD_ROMCACHE_SIZE;
     int i;
     for (i=e820_count-1; i>=0; i--) {
         struct e820entry *en = &e820_list[i];
@@ -321,7 +482,7 @@ malloc_preinit(void)
             continue;
         u32 s = en->start, e = end;
         if (!highram) {
-            u32 newe = ALIGN_DOWN(e - BUILD_MAX_HIGHTABLE, MALLOC_MIN_ALIGN);
+            u32 newe = ALIGN_DOWN(e - highsize, MALLOC_MIN_ALIGN);
             if (newe <= e && newe >= s) {
                 highram = newe;
                 e = newe;
@@ -336,6 +497,13 @@ malloc_preinit(void)
         addSpace(&ZoneHigh, (void*)highram
                  , (void*)highram + BUILD_MAX_HIGHTABLE);
         add_e820(highram, BUILD_MAX_HIGHTABLE, E820_RESERVED);
+        if (CONFIG_OPTIONROMS_CACHE) {
+            // The option rom cache sits above ZoneHigh so that it is
+            // at the same address on the next boot.
+            u32 cache = highram + BUILD_MAX_HIGHTABLE;
+            add_e820(cache, BUILD_ROMCACHE_SIZE, E820_RESERVED);
+            RomCache = (void*)cache;
+        }
     }
 }
 
@@ -374,6 +542,14 @@ calcRamSize(void)
     LegacyRamSize = rs >= 1024*1024 ? rs : 1024*1024;
 }
 
+// Update the back pointer of the first entry of a relocated list head.
+static void
+fixupHead(struct hlist_head *head)
+{
+    if (head->first)
+        head->first->pprev = &head->first;
+}
+
 // Update pointers after code relocation.
 void
 malloc_init(void)
@@ -383,12 +559,17 @@ malloc_init(void)
 
     if (CONFIG_RELOCATE_INIT) {
         // Fixup malloc pointers after relocation
-        int i;
+        int i, j;
         for (i=0; i<ARRAY_SIZE(Zones); i++) {
             struct zone_s *zone = Zones[i];
-            if (zone->head.first)
-                zone->head.first->pprev = &zone->head.first;
+            fixupHead(&zone->head);
+            for (j=0; j<ZONE_FREE_LISTS; j++)
+                fixupHead(&zone->free[j]);
         }
+        for (i=0; i<ARRAY_SIZE(AllocHash); i++)
+            fixupHead(&AllocHash[i]);
+        for (i=0; i<ARRAY_SIZE(HandleHash); i++)
+            fixupHead(&HandleHash[i]);
     }
 
     // Initialize low-memory region
@@ -405,12 +586,39 @@ malloc_init(void)
     calcRamSize();
 }
 
+// Report the peak usage and fragmentation of each zone.
+static void
+malloc_report(void)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++) {
+        struct zone_s *zone = Zones[i];
+        u32 count = 0, space = 0, maxspace = 0, frags = 0;
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &zone->head, node) {
+            count++;
+            u32 s = info->allocend - info->dataend;
+            space += s;
+            if (s > maxspace)
+                maxspace = s;
+            if (s >= MALLOC_MIN_ALIGN)
+                frags++;
+        }
+        dprintf(1, "zone %s: used=%d peak=%d areas=%d free=%d in %d"
+                " fragments (largest %d)\n", ZoneNames[i]
+                , zone->used, zone->peak, count, space, frags, maxspace);
+    }
+}
+
 void
 malloc_prepboot(void)
 {
     ASSERT32FLAT();
     dprintf(3, "malloc finalize\n");
 
+    arena_free_all();
+    malloc_report();
+
     // Place an optionrom signature around used low mem area.
     u32 base = rom_get_max();
     struct rom_header *dummyrom = (void*)base;
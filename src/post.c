@@ -27,6 +27,8 @@
 #include "megasas.h" // megasas_setup
 #include "tpm.h" // tpm_setup
 #include "post.h" // interface_init
+#include "trace.h" // profile_prepboot
+#include "pci.h" // pci_prepboot
 
 
 /****************************************************************
@@ -107,6 +109,7 @@ interface_init(void)
 {
     // Running at new code address - do code relocation fixups
     malloc_init();
+    bootprof_init();
 
     // Setup romfile items.
     qemu_cfg_init();
@@ -129,21 +132,21 @@ interface_init(void)
 void
 device_hardware_setup(void)
 {
-    usb_setup();
-    ps2port_setup();
-    lpt_setup();
-    serial_setup();
-
-    floppy_setup();
-    ata_setup();
-    ahci_setup();
-    cbfs_payload_setup();
-    ramdisk_setup();
-    virtio_blk_setup();
-    virtio_scsi_setup();
-    lsi_scsi_setup();
-    esp_scsi_setup();
-    megasas_setup();
+    BOOTPROF(usb_setup);
+    BOOTPROF(ps2port_setup);
+    BOOTPROF(lpt_setup);
+    BOOTPROF(serial_setup);
+
+    BOOTPROF(floppy_setup);
+    BOOTPROF(ata_setup);
+    BOOTPROF(ahci_setup);
+    BOOTPROF(cbfs_payload_setup);
+    BOOTPROF(ramdisk_setup);
+    BOOTPROF(virtio_blk_setup);
+    BOOTPROF(virtio_scsi_setup);
+    BOOTPROF(lsi_scsi_setup);
+    BOOTPROF(esp_scsi_setup);
+    BOOTPROF(megasas_setup);
 }
 
 static void
@@ -158,11 +161,11 @@ platform_hardware_setup(void)
     // Init base pc hardware.
     pic_setup();
     mathcp_setup();
-    timer_setup();
+    BOOTPROF(timer_setup);
 
     // Platform specific setup
-    qemu_platform_setup();
-    coreboot_platform_setup();
+    BOOTPROF(qemu_platform_setup);
+    BOOTPROF(coreboot_platform_setup);
 }
 
 void
@@ -170,9 +173,13 @@ prepareboot(void)
 {
     // Run BCVs
     bcv_prepboot();
+    thread_prepboot();
+    profile_prepboot();
 
     // Finalize data structures before boot
     cdrom_prepboot();
+    firmware_log_prepboot();
+    pci_prepboot();
     pmm_prepboot();
     malloc_prepboot();
     memmap_prepboot();
@@ -186,7 +193,8 @@ void VISIBLE32FLAT
 startBoot(void)
 {
     // Clear low-memory allocations (required by PMM spec).
-    memset((void*)BUILD_STACK_ADDR, 0, BUILD_EBDA_MINIMUM - BUILD_STACK_ADDR);
+    smp_memset((void*)BUILD_STACK_ADDR, 0, BUILD_EBDA_MINIMUM - BUILD_STACK_ADDR);
+    smp_dispatch_finish();
 
     dprintf(3, "Jump to int19\n");
     struct bregs br;
@@ -203,30 +211,39 @@ maininit(void)
     interface_init();
 
     // Setup platform devices.
-    platform_hardware_setup();
+    BOOTPROF(platform_hardware_setup);
 
     // Start hardware initialization (if optionrom threading)
     if (CONFIG_THREAD_OPTIONROMS)
-        device_hardware_setup();
+        BOOTPROF(device_hardware_setup);
 
     // Run vga option rom
-    vgarom_setup();
+    BOOTPROF(vgarom_setup);
 
     // Do hardware initialization (if running synchronously)
     if (!CONFIG_THREAD_OPTIONROMS) {
-        device_hardware_setup();
-        wait_threads();
+        BOOTPROF(device_hardware_setup);
+        BOOTPROF(boot_wait_threads);
     }
 
     // Setup TPM
-    tpm_setup();
+    BOOTPROF(tpm_setup);
+
+    // Load the splash picture while option roms run
+    preload_bootsplash();
 
     // Run option roms
-    optionrom_setup();
+    BOOTPROF(optionrom_setup);
 
     // Allow user to modify overall boot order.
-    interactive_bootmenu();
-    wait_threads();
+    BOOTPROF(interactive_bootmenu);
+    BOOTPROF(boot_wait_threads);
+
+    // Run the option roms still needed for the chosen boot order.
+    BOOTPROF(boot_lazy_roms);
+
+    // Report where the boot time went.
+    bootprof_report();
 
     // Prepare for boot.
     prepareboot();
@@ -300,6 +317,7 @@ dopost(void)
     qemu_preinit();
     coreboot_preinit();
     malloc_preinit();
+    firmware_log_setup();
 
     // Relocate initialization code and call maininit().
     reloc_preinit(maininit, NULL);
@@ -419,6 +419,9 @@ done:
 static void
 ps2_keyboard_setup(void *data)
 {
+    // Keep the keyboard even if the other init threads are cancelled.
+    thread_nocancel();
+
     /* flush incoming keys */
     int ret = i8042_flush();
     if (ret)
@@ -75,6 +75,72 @@ romfile_loadfile(const char *name, int *psize)
     return data;
 }
 
+// State of a romfile being loaded by a background thread.
+struct romfile_preload_s {
+    struct romfile_s *file;
+    char *data;
+    int ret, done;
+};
+
+static void
+preload_thread(void *arg)
+{
+    struct romfile_preload_s *preload = arg;
+    // Return to the caller before doing the (possibly slow) copy.
+    yield();
+    struct romfile_s *file = preload->file;
+    dprintf(5, "Preloading romfile '%s' (len %d)\n", file->name, file->size);
+    preload->ret = file->copy(file, preload->data, file->size);
+    preload->done = 1;
+}
+
+// Start copying (and uncompressing) a romfile to malloc_tmphigh
+// memory in a background thread.  The result must be obtained with
+// romfile_preload_finish().
+struct romfile_preload_s *
+romfile_preload(struct romfile_s *file)
+{
+    if (!file || !file->size)
+        return NULL;
+    struct romfile_preload_s *preload = malloc_tmphigh(sizeof(*preload));
+    char *data = malloc_tmphigh(file->size+1);
+    if (!preload || !data) {
+        warn_noalloc();
+        free(preload);
+        free(data);
+        return NULL;
+    }
+    memset(preload, 0, sizeof(*preload));
+    preload->file = file;
+    preload->data = data;
+    // Decompressors may use more stack than the default thread stack
+    run_thread_stack(preload_thread, preload, 8192);
+    return preload;
+}
+
+// Wait for a romfile_preload() request to complete.  Returns the
+// malloc'd copy (with a trailing zero) or NULL on failure.
+void *
+romfile_preload_finish(struct romfile_preload_s *preload, int *psize)
+{
+    if (!preload)
+        return NULL;
+    while (!preload->done)
+        yield();
+    struct romfile_s *file = preload->file;
+    char *data = preload->data;
+    int ret = preload->ret;
+    free(preload);
+    if (ret <= 0) {
+        free(data);
+        return NULL;
+    }
+    if (psize)
+        *psize = file->size;
+    data[file->size] = '\0';
+    return data;
+}
+
 // Attempt to load an integer from the given file - return 'defval'
 // if unsuccesful.
 u64
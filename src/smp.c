@@ -8,6 +8,7 @@
 #include "util.h" // dprintf
 #include "config.h" // CONFIG_*
 #include "cmos.h" // CMOS_BIOS_SMP_COUNT
+#include "bregs.h" // CR0_PE
 
 #define APIC_ICR_LOW ((u8*)BUILD_APIC_ADDR + 0x300)
 #define APIC_SVR     ((u8*)BUILD_APIC_ADDR + 0x0F0)
@@ -35,8 +36,11 @@ wrmsr_smp(u32 index, u64 val)
 
 u32 CountCPUs VARFSEG;
 u32 MaxCountCPUs VARFSEG;
-// 256 bits for the found APIC IDs
-u32 FoundAPICIDs[256/32] VARFSEG;
+// List of found APIC IDs (in low memory, filled in by the processors)
+u32 SmpApicIdSeg VARFSEG, SmpApicIdPos VARFSEG, SmpApicIdEnd VARFSEG;
+// Stack space for processors parking in the job dispatch loop
+u32 SmpStackPos VARFSEG, SmpStackEnd VARFSEG;
+#define SMP_AP_STACK_SIZE 4096
 extern void smp_ap_boot_code(void);
 ASM16(
     "  .global smp_ap_boot_code\n"
@@ -60,25 +64,359 @@ ASM16(
     "  jmp 1b\n"
     "2:\n"
 
-    // get apic ID on EBX, set bit on FoundAPICIDs
-    "  movl $1, %eax\n"
+    // get apic ID on EBX (the full x2APIC ID if cpuid leaf 0xb is
+    // implemented - it reports ebx==0 for subleaf 0 otherwise)
+    "  xorl %eax, %eax\n"
+    "  cpuid\n"
+    "  cmpl $0x0b, %eax\n"
+    "  jb 3f\n"
+    "  movl $0x0b, %eax\n"
+    "  xorl %ecx, %ecx\n"
+    "  cpuid\n"
+    "  testl %ebx, %ebx\n"
+    "  jz 3f\n"
+    "  movl %edx, %ebx\n"
+    "  jmp 4f\n"
+    "3:movl $1, %eax\n"
     "  cpuid\n"
     "  shrl $24, %ebx\n"
-    "  lock btsl %ebx, FoundAPICIDs\n"
+
+    // Append the apic ID to the found APIC ID list
+    "4:movl $4, %eax\n"
+    "  lock xaddl %eax, SmpApicIdPos\n"
+    "  cmpl SmpApicIdEnd, %eax\n"
+    "  jae 5f\n"
+    "  movw SmpApicIdSeg, %cx\n"
+    "  movw %cx, %es\n"
+    "  movl %ebx, %es:(%eax)\n"
+    "5:\n"
 
     // Increment the cpu counter
     "  lock incl CountCPUs\n"
 
+    // Reserve a stack for the job dispatch loop (if enabled)
+    "  movl $-" __stringify(SMP_AP_STACK_SIZE) ", %eax\n"
+    "  lock xaddl %eax, SmpStackPos\n"
+    "  cmpl SmpStackEnd, %eax\n"
+    "  jbe 1f\n"
+    "  movl %eax, %esp\n"
+
+    // Enter 32bit flat mode (with caching enabled)
+    "  lidtw %cs:pmode_IDT_info\n"
+    "  lgdtw %cs:rombios32_gdt_48\n"
+    "  movl %cr0, %eax\n"
+    "  andl $~(" __stringify(CR0_CD|CR0_NW) "), %eax\n"
+    "  orl $" __stringify(CR0_PE) ", %eax\n"
+    "  movl %eax, %cr0\n"
+    "  ljmpl $" __stringify(SEG32_MODE32_CS) ", $(" __stringify(BUILD_BIOS_ADDR) " + 2f)\n"
+    "  .code32\n"
+    "2:movl $" __stringify(SEG32_MODE32_DS) ", %eax\n"
+    "  movw %ax, %ds\n"
+    "  movw %ax, %es\n"
+    "  movw %ax, %ss\n"
+    "  movw %ax, %fs\n"
+    "  movw %ax, %gs\n"
+
+    // Run jobs until released - returns pointer to the parked count
+    "  movl $_cfunc32flat_handle_smp_ap, %eax\n"
+    "  calll *%eax\n"
+    "  lock decl (%eax)\n"
+
+    // Return to 16bit real mode (the stack may no longer be used)
+    "  movl $" __stringify(SEG32_MODE16_DS) ", %eax\n"
+    "  movw %ax, %ds\n"
+    "  movw %ax, %es\n"
+    "  movw %ax, %ss\n"
+    "  movw %ax, %fs\n"
+    "  movw %ax, %gs\n"
+    "  ljmpw $" __stringify(SEG32_MODE16_CS) ", $3f\n"
+    "  .code16gcc\n"
+    "3:movl %cr0, %eax\n"
+    "  andl $~" __stringify(CR0_PE) ", %eax\n"
+    "  movl %eax, %cr0\n"
+    "  ljmpw $" __stringify(SEG_BIOS) ", $4f\n"
+    "4:lidtw %cs:rmode_IDT_info\n"
+    "  xorw %ax, %ax\n"
+    "  movw %ax, %ds\n"
+    "  movw %ax, %es\n"
+    "  movw %ax, %ss\n"
+    "  movw %ax, %fs\n"
+    "  movw %ax, %gs\n"
+
     // Halt the processor.
     "1:hlt\n"
     "  jmp 1b\n"
     );
 
-int apic_id_is_present(u8 apic_id)
+
+
+/****************************************************************
+ * Application processor job dispatch
+ ****************************************************************/
+
+// Job queue state - stored in temporary high memory so that it
+// remains writable after the f-segment is made read-only.
+struct smp_dispatch_s {
+    u32 lock;
+    u32 head, tail;
+    u32 parked, exit;
+    struct smp_job_s *queue[64];
+};
+struct smp_dispatch_s *SmpDispatch VARFSEG;
+
+static inline u32
+xchgl(u32 *ptr, u32 val)
+{
+    asm volatile("xchgl %0, %1" : "+r"(val), "+m"(*ptr) : : "memory");
+    return val;
+}
+
+static inline void
+atomic_incl(u32 *ptr)
+{
+    asm volatile("lock incl %0" : "+m"(*ptr) : : "memory");
+}
+
+static void
+smp_lock(struct smp_dispatch_s *d)
+{
+    while (xchgl(&d->lock, 1))
+        cpu_relax();
+}
+
+static void
+smp_unlock(struct smp_dispatch_s *d)
+{
+    barrier();
+    writel(&d->lock, 0);
+}
+
+// Remove the next job from the queue (or return NULL if none).
+static struct smp_job_s *
+smp_job_get(struct smp_dispatch_s *d)
+{
+    if (!d || readl(&d->head) == readl(&d->tail))
+        return NULL;
+    struct smp_job_s *job = NULL;
+    smp_lock(d);
+    if (d->head != d->tail)
+        job = d->queue[d->head++ % ARRAY_SIZE(d->queue)];
+    smp_unlock(d);
+    return job;
+}
+
+static void
+smp_job_run(struct smp_job_s *job)
+{
+    job->func(job->data);
+    barrier();
+    writel(&job->done, 1);
+}
+
+// Main loop of parked application processors (entered from
+// smp_ap_boot_code).  Returns the address of the parked count which
+// the caller decrements once it no longer uses its stack.
+u32 VISIBLE32FLAT
+handle_smp_ap(void)
+{
+    struct smp_dispatch_s *d = SmpDispatch;
+    atomic_incl(&d->parked);
+    while (!readl(&d->exit)) {
+        struct smp_job_s *job = smp_job_get(d);
+        if (job)
+            smp_job_run(job);
+        else
+            cpu_relax();
+    }
+    return (u32)&d->parked;
+}
+
+// Queue a job to run on an application processor.  The job is run
+// immediately if no processors are available.  Jobs must not call
+// malloc, yield, or any other non reentrant code.
+void
+smp_job_submit(struct smp_job_s *job)
+{
+    job->done = 0;
+    struct smp_dispatch_s *d = SmpDispatch;
+    if (!CONFIG_SMP_JOBS || !d || d->exit || !d->parked)
+        goto run;
+    smp_lock(d);
+    if (d->tail - d->head >= ARRAY_SIZE(d->queue)) {
+        // Queue full
+        smp_unlock(d);
+        goto run;
+    }
+    d->queue[d->tail++ % ARRAY_SIZE(d->queue)] = job;
+    smp_unlock(d);
+    return;
+run:
+    smp_job_run(job);
+}
+
+// Wait for a job to complete (running queued jobs while waiting).
+void
+smp_job_wait(struct smp_job_s *job)
+{
+    while (!readl(&job->done)) {
+        struct smp_job_s *next = smp_job_get(SmpDispatch);
+        if (next)
+            smp_job_run(next);
+        else
+            yield();
+    }
+}
+
+// Number of processors that may run jobs (including the current one).
+static u32
+smp_job_cpus(void)
 {
+    struct smp_dispatch_s *d = SmpDispatch;
+    if (!CONFIG_SMP_JOBS || !d || d->exit)
+        return 1;
+    return readl(&d->parked) + 1;
+}
+
+struct memset_job_s {
+    struct smp_job_s job;
+    void *s;
+    size_t n;
+    int c;
+};
+
+static void
+memset_job(void *data)
+{
+    struct memset_job_s *mj = data;
+    memset(mj->s, mj->c, mj->n);
+}
+
+#define SMP_MEMSET_MIN (64*1024)
+
+// Fill a large memory area using all available processors.
+void
+smp_memset(void *s, int c, size_t n)
+{
+    struct memset_job_s jobs[16];
+    u32 count = smp_job_cpus();
+    if (count > ARRAY_SIZE(jobs))
+        count = ARRAY_SIZE(jobs);
+    if (count > n / SMP_MEMSET_MIN)
+        count = n / SMP_MEMSET_MIN;
+    if (count <= 1) {
+        memset(s, c, n);
+        return;
+    }
+    size_t chunk = ALIGN(DIV_ROUND_UP(n, count), 64);
+    int i;
+    for (i=0; i<count && n; i++) {
+        struct memset_job_s *mj = &jobs[i];
+        mj->job.func = memset_job;
+        mj->job.data = mj;
+        mj->s = s;
+        mj->n = n < chunk ? n : chunk;
+        mj->c = c;
+        s += mj->n;
+        n -= mj->n;
+        if (i)
+            smp_job_submit(&mj->job);
+    }
+    count = i;
+    // Fill the first chunk on this cpu.
+    smp_job_run(&jobs[0].job);
+    for (i=1; i<count; i++)
+        smp_job_wait(&jobs[i].job);
+}
+
+// Reserve stacks so that the application processors woken by
+// smp_setup() park in the job dispatch loop.
+static void
+smp_dispatch_setup(u32 count)
+{
+    if (!CONFIG_SMP_JOBS || !count)
+        return;
+    struct smp_dispatch_s *d = malloc_tmphigh(sizeof(*d));
+    void *stacks = memalign_tmphigh(SMP_AP_STACK_SIZE
+                                    , count * SMP_AP_STACK_SIZE);
+    if (!d || !stacks) {
+        warn_noalloc();
+        free(d);
+        free(stacks);
+        return;
+    }
+    memset(d, 0, sizeof(*d));
+    SmpDispatch = d;
+    SmpStackEnd = (u32)stacks;
+    SmpStackPos = (u32)stacks + count * SMP_AP_STACK_SIZE;
+}
+
+// Release the parked application processors back to their halt loop.
+void
+smp_dispatch_finish(void)
+{
+    struct smp_dispatch_s *d = SmpDispatch;
+    if (!CONFIG_SMP_JOBS || !d || d->exit)
+        return;
+    writel(&d->exit, 1);
+    while (readl(&d->parked))
+        cpu_relax();
+    dprintf(3, "Released job dispatch cpus\n");
+}
+
+
+/****************************************************************
+ * CPU detection
+ ****************************************************************/
+
+// Bitmap of found APIC IDs (built from the list filled in at SIPI time)
+static u32 *FoundAPICIDs;
+u32 MaxAPICID;
+
+int apic_id_is_present(u32 apic_id)
+{
+    if (!FoundAPICIDs || apic_id > MaxAPICID)
+        return 0;
     return !!(FoundAPICIDs[apic_id/32] & (1ul << (apic_id % 32)));
 }
 
+// Return the APIC ID of the current cpu (the full x2APIC ID if known).
+static u32
+get_apic_id(void)
+{
+    u32 eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x0b) {
+        asm("cpuid"
+            : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+            : "0"(0x0b), "2"(0));
+        if (ebx)
+            return edx;
+        // Leaf 0xb not implemented - use the leaf 1 id.
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+// Build the FoundAPICIDs bitmap from the list of reported APIC IDs.
+static void
+smp_found_apic_ids(u32 *ids, u32 count)
+{
+    u32 maxid = 0, i;
+    for (i=0; i<count; i++)
+        if (ids[i] > maxid)
+            maxid = ids[i];
+    u32 size = DIV_ROUND_UP(maxid + 1, 32) * sizeof(u32);
+    FoundAPICIDs = malloc_tmphigh(size);
+    if (!FoundAPICIDs) {
+        warn_noalloc();
+        return;
+    }
+    memset(FoundAPICIDs, 0, size);
+    for (i=0; i<count; i++)
+        FoundAPICIDs[ids[i]/32] |= 1ul << (ids[i] % 32);
+    MaxAPICID = maxid;
+}
+
 // find and initialize the CPUs by launching a SIPI to them
 void
 smp_setup(void)
@@ -97,12 +435,32 @@ smp_setup(void)
         return;
     }
 
-    // mark the BSP initial APIC ID as found, too:
-    u8 apic_id = ebx>>24;
-    FoundAPICIDs[apic_id/32] |= (1 << (apic_id % 32));
+    if (ecx & CPUID_EXT_X2APIC)
+        dprintf(3, "x2APIC supported\n");
+
+    // Determine the number of cpus to wait for.  The cmos count is
+    // limited to 8 bits, so prefer the fw_cfg count if available.
+    u32 boot_cpus = romfile_loadint("etc/boot-cpus", 0);
+    u32 cmos_smp_count = inb_cmos(CMOS_BIOS_SMP_COUNT) + 1;
+    if (boot_cpus < cmos_smp_count)
+        boot_cpus = cmos_smp_count;
+
+    // Allocate the found APIC ID list and mark the BSP as found, too.
+    u32 *ids = memalign_tmplow(16, boot_cpus * sizeof(u32));
+    if (!ids) {
+        warn_noalloc();
+        CountCPUs = 1;
+        MaxCountCPUs = 1;
+        return;
+    }
+    ids[0] = get_apic_id();
+    SmpApicIdSeg = FLATPTR_TO_SEG(ids);
+    SmpApicIdPos = sizeof(u32);
+    SmpApicIdEnd = boot_cpus * sizeof(u32);
 
     // Init the counter.
     writel(&CountCPUs, 1);
+    smp_dispatch_setup(boot_cpus - 1);
 
     // Setup jump trampoline to counter code.
     u64 old = *(u64*)BUILD_AP_BOOT_ADDR;
@@ -128,17 +486,25 @@ smp_setup(void)
     writel(APIC_ICR_LOW, 0x000C4600 | sipi_vector);
 
     // Wait for other CPUs to process the SIPI.
-    u8 cmos_smp_count = inb_cmos(CMOS_BIOS_SMP_COUNT);
-    while (cmos_smp_count + 1 != readl(&CountCPUs))
+    while (boot_cpus != readl(&CountCPUs))
         yield();
+    if (SmpDispatch) {
+        // Wait for the CPUs to enter the job dispatch loop.
+        while (boot_cpus - 1 != readl(&SmpDispatch->parked))
+            yield();
+        dprintf(1, "Parked %d cpu(s) for job dispatch\n", boot_cpus - 1);
+    }
 
     // Restore memory.
     *(u64*)BUILD_AP_BOOT_ADDR = old;
 
+    smp_found_apic_ids(ids, boot_cpus);
+    free(ids);
+
     MaxCountCPUs = romfile_loadint("etc/max-cpus", 0);
     if (!MaxCountCPUs || MaxCountCPUs < CountCPUs)
         MaxCountCPUs = CountCPUs;
 
-    dprintf(1, "Found %d cpu(s) max supported %d cpu(s)\n", readl(&CountCPUs),
-        MaxCountCPUs);
+    dprintf(1, "Found %d cpu(s) max supported %d cpu(s) max apic id %d\n"
+            , readl(&CountCPUs), MaxCountCPUs, MaxAPICID);
 }
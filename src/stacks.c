@@ -242,18 +242,38 @@ __call16_int(struct bregs *callregs, u16 offset)
 struct thread_info {
     void *stackpos;
     struct hlist_node node;
+    int profid;
+    u64 wake;
+    void *func;
+    u32 stacksize;
+    u8 nocancel;
 };
 struct thread_info MainThread VARFSEG = {
     NULL, { &MainThread.node, &MainThread.node.next }
 };
 #define THREADSTACKSIZE 4096
+// All thread stacks are aligned to the maximum stack size so that the
+// thread_info can be found from any stack position.
+#define THREADSTACKMAX 16384
+
+// Threads blocked in a timed sleep - sorted by wake up time.  A thread
+// is either on the MainThread ring (runnable) or on this list.
+struct hlist_head SleepQueue VARFSEG;
+
+// Check if any threads are runnable (other than the main thread).
+static int
+have_runnable(void)
+{
+    return (CONFIG_THREADS
+            && GET_FLATPTR(MainThread.node.next) != &MainThread.node);
+}
 
 // Check if any threads are running.
 static int
 have_threads(void)
 {
     return (CONFIG_THREADS
-            && GET_FLATPTR(MainThread.node.next) != &MainThread.node);
+            && (have_runnable() || GET_FLATPTR(SleepQueue.first)));
 }
 
 // Return the 'struct thread_info' for the currently running thread.
@@ -263,15 +283,13 @@ getCurThread(void)
     u32 esp = getesp();
     if (esp <= BUILD_STACK_ADDR)
         return &MainThread;
-    return (void*)ALIGN_DOWN(esp, THREADSTACKSIZE);
+    return (void*)ALIGN_DOWN(esp, THREADSTACKMAX);
 }
 
-// Switch to next thread stack.
+// Switch from the current thread stack to the given thread.
 static void
-switch_next(struct thread_info *cur)
+switch_to(struct thread_info *cur, struct thread_info *next)
 {
-    struct thread_info *next = container_of(
-        cur->node.next, struct thread_info, node);
     if (cur == next)
         // Nothing to do.
         return;
@@ -288,30 +306,142 @@ switch_next(struct thread_info *cur)
         : "ebx", "edx", "esi", "edi", "cc", "memory");
 }
 
+// Switch to next thread stack.
+static void
+switch_next(struct thread_info *cur)
+{
+    switch_to(cur, container_of(cur->node.next, struct thread_info, node));
+}
+
+
+/****************************************************************
+ * Thread stack pool
+ ****************************************************************/
+
+// Unused thread stacks available for reuse.
+static struct hlist_head ThreadStackPool VARVERIFY32INIT;
+
+// Peak stack usage of each thread function.
+struct thread_stack_use_s {
+    void *func;
+    u32 stacksize, peak, count;
+};
+static struct thread_stack_use_s ThreadStackUse[32] VARVERIFY32INIT;
+
+#define THREADSTACK_CANARY 0x5a5a5a5a
+
+// Obtain a stack (from the pool if possible) of at least 'size' bytes.
+static struct thread_info *
+thread_stack_alloc(u32 size)
+{
+    if (size > THREADSTACKMAX) {
+        dprintf(1, "Thread stack of %d bytes exceeds the %d byte maximum\n"
+                , size, THREADSTACKMAX);
+        return NULL;
+    }
+    u32 stacksize = THREADSTACKSIZE;
+    while (stacksize < size)
+        stacksize <<= 1;
+    struct thread_info *thread;
+    hlist_for_each_entry(thread, &ThreadStackPool, node) {
+        if (thread->stacksize == stacksize) {
+            hlist_del(&thread->node);
+            goto found;
+        }
+    }
+    thread = memalign_tmphigh(THREADSTACKMAX, stacksize);
+    if (!thread)
+        return NULL;
+    thread->stacksize = stacksize;
+found:
+    // Fill the stack with a canary so the peak usage can be found.
+    memset(&thread[1], THREADSTACK_CANARY & 0xff
+           , stacksize - sizeof(*thread));
+    return thread;
+}
+
+// Record the peak stack usage of a completed thread and place its
+// stack in the pool.
+static void
+thread_stack_free(struct thread_info *thread)
+{
+    u32 *pos = (void*)&thread[1], *end = (void*)thread + thread->stacksize;
+    while (pos < end && *pos == THREADSTACK_CANARY)
+        pos++;
+    u32 peak = (void*)end - (void*)pos;
+    if (peak + sizeof(u32) > thread->stacksize - sizeof(*thread))
+        dprintf(1, "Thread %p may have overflowed its stack (%d bytes)\n"
+                , thread->func, thread->stacksize);
+
+    struct thread_stack_use_s *use;
+    for (use = ThreadStackUse; use < &ThreadStackUse[ARRAY_SIZE(ThreadStackUse)]
+             ; use++) {
+        if (use->func && use->func != thread->func)
+            continue;
+        use->func = thread->func;
+        use->stacksize = thread->stacksize;
+        if (peak > use->peak)
+            use->peak = peak;
+        use->count++;
+        break;
+    }
+
+    hlist_add_head(&thread->node, &ThreadStackPool);
+}
+
+// Report thread stack usage and release the pooled stacks.
+void
+thread_prepboot(void)
+{
+    if (!CONFIG_THREADS)
+        return;
+    struct thread_stack_use_s *use;
+    for (use = ThreadStackUse; use < &ThreadStackUse[ARRAY_SIZE(ThreadStackUse)]
+             && use->func; use++)
+        dprintf(3, "Thread %p: %d runs, peak stack %d of %d bytes\n"
+                , use->func, use->count, use->peak, use->stacksize);
+
+    struct thread_info *thread;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(thread, n, &ThreadStackPool, node) {
+        hlist_del(&thread->node);
+        free(thread);
+    }
+}
+
+
+/****************************************************************
+ * Thread creation
+ ****************************************************************/
+
 // Last thing called from a thread (called on "next" stack).
 static void
 __end_thread(struct thread_info *old)
 {
     hlist_del(&old->node);
-    free(old);
+    bootprof_end(old->profid);
+    thread_stack_free(old);
     dprintf(DEBUG_thread, "\\%08x/ End thread\n", (u32)old);
     if (!have_threads())
         dprintf(1, "All threads complete.\n");
 }
 
-// Create a new thread and start executing 'func' in it.
+// Create a new thread with a stack of at least 'stacksize' bytes and
+// start executing 'func' in it.
 void
-run_thread(void (*func)(void*), void *data)
+run_thread_stack(void (*func)(void*), void *data, u32 stacksize)
 {
     ASSERT32FLAT();
     if (! CONFIG_THREADS)
         goto fail;
-    struct thread_info *thread;
-    thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
+    struct thread_info *thread = thread_stack_alloc(stacksize);
     if (!thread)
         goto fail;
 
-    thread->stackpos = (void*)thread + THREADSTACKSIZE;
+    thread->stackpos = (void*)thread + thread->stacksize;
+    thread->func = func;
+    thread->nocancel = 0;
+    thread->profid = bootprof_begin("thread", func);
     struct thread_info *cur = getCurThread();
     hlist_add_after(&thread->node, &cur->node);
 
@@ -341,6 +471,96 @@ fail:
     func(data);
 }
 
+// Create a new thread and start executing 'func' in it.
+void
+run_thread(void (*func)(void*), void *data)
+{
+    run_thread_stack(func, data, THREADSTACKSIZE);
+}
+
+
+/****************************************************************
+ * Timed sleeps
+ ****************************************************************/
+
+// Return the sleeping thread that is due to wake first (or NULL).
+static struct thread_info *
+first_sleeper(void)
+{
+    return container_of_or_null(SleepQueue.first, struct thread_info, node);
+}
+
+// Move threads whose sleep has expired back onto the runnable ring.
+static void
+wake_sleepers(void)
+{
+    struct thread_info *t;
+    while ((t = first_sleeper()) && __check_tsc(t->wake)) {
+        hlist_del(&t->node);
+        hlist_add_after(&t->node, &MainThread.node);
+    }
+}
+
+// Remove the current thread from the runnable ring until 'end'.
+static void
+thread_sleep(struct thread_info *cur, u64 end)
+{
+    struct thread_info *next = container_of(
+        cur->node.next, struct thread_info, node);
+    hlist_del(&cur->node);
+    cur->wake = end;
+    struct thread_info *t;
+    struct hlist_node **pprev;
+    hlist_for_each_entry_pprev(t, pprev, &SleepQueue, node) {
+        if ((s64)(t->wake - end) > 0)
+            break;
+    }
+    hlist_add(&cur->node, pprev);
+    switch_to(cur, next);
+}
+
+// Nothing other than the main thread can run - wait for irqs until
+// 'end' or the next sleeping thread is due.  The cpu is halted if the
+// wait is longer than a timer tick.
+static void
+thread_idle(u64 end)
+{
+    struct thread_info *t = first_sleeper();
+    if (t && (s64)(end - t->wake) > 0)
+        end = t->wake;
+    u64 tick = (u64)get_tsc_khz() * 55;
+    if (__check_tsc(end - tick)) {
+        yield();
+        return;
+    }
+    extern void _cfunc16_wait_irq(void);
+    call16big(0, _cfunc16_wait_irq);
+    wake_sleepers();
+}
+
+// Sleep until the given get_tsc() time while letting other threads run.
+void
+yield_until(u64 end)
+{
+    if (MODESEGMENT || !CONFIG_THREADS) {
+        while (!__check_tsc(end))
+            yield();
+        return;
+    }
+    struct thread_info *cur = getCurThread();
+    if (cur != &MainThread) {
+        if (!__check_tsc(end))
+            thread_sleep(cur, end);
+        return;
+    }
+    while (!__check_tsc(end)) {
+        if (have_runnable())
+            yield();
+        else
+            thread_idle(end);
+    }
+}
+
 
 /****************************************************************
  * Thread helpers
@@ -367,9 +587,11 @@ yield(void)
         return;
     }
     struct thread_info *cur = getCurThread();
-    if (cur == &MainThread)
+    if (cur == &MainThread) {
         // Permit irqs to fire
         call16big(0, _cfunc16_check_irqs);
+        wake_sleepers();
+    }
 
     // Switch to the next thread
     switch_next(cur);
@@ -403,8 +625,68 @@ void
 wait_threads(void)
 {
     ASSERT32FLAT();
-    while (have_threads())
-        yield();
+    while (have_threads()) {
+        if (have_runnable())
+            yield();
+        else
+            thread_idle(first_sleeper()->wake);
+    }
+}
+
+// Wait for all threads to complete or until '*done' becomes non-zero.
+void
+wait_threads_until(int *done)
+{
+    ASSERT32FLAT();
+    while (have_threads() && !*done) {
+        if (have_runnable())
+            yield();
+        else
+            thread_idle(first_sleeper()->wake);
+    }
+}
+
+// Set while the remaining init threads are being cancelled.
+int ThreadCancel VARFSEG;
+
+// Check if the current thread has been asked to give up.
+int
+thread_cancelled(void)
+{
+    if (MODESEGMENT || !CONFIG_THREADS || !GET_GLOBAL(ThreadCancel))
+        return 0;
+    struct thread_info *cur = getCurThread();
+    return cur != &MainThread && !cur->nocancel;
+}
+
+// Mark the current thread as one that always runs to completion.
+void
+thread_nocancel(void)
+{
+    struct thread_info *cur = getCurThread();
+    if (cur != &MainThread)
+        cur->nocancel = 1;
+}
+
+// Ask the remaining threads to give up and wait for them to exit.
+// Their timeouts (check_tsc) expire immediately, so each thread leaves
+// through its driver's timeout path - the same path taken when a
+// device stops responding.  Delays still run their full length.
+// Returns the number of threads that were cancelled.
+int
+cancel_threads(void)
+{
+    ASSERT32FLAT();
+    int count = 0;
+    struct hlist_node *n;
+    for (n = MainThread.node.next; n != &MainThread.node; n = n->next)
+        count += !container_of(n, struct thread_info, node)->nocancel;
+    for (n = SleepQueue.first; n; n = n->next)
+        count += !container_of(n, struct thread_info, node)->nocancel;
+    ThreadCancel = 1;
+    wait_threads();
+    ThreadCancel = 0;
+    return count;
 }
 
 void
@@ -476,6 +758,7 @@ void VISIBLE32INIT
 yield_preempt(void)
 {
     PreemptCount++;
+    wake_sleepers();
     switch_next(&MainThread);
 }
 
@@ -227,9 +227,11 @@ handle_1589(struct bregs *regs)
 }
 
 // Device busy interrupt.  Called by Int 16h when no key available
+// (and by option roms waiting on their hardware).
 static void
 handle_1590(struct bregs *regs)
 {
+    check_preempt();
 }
 
 // Interrupt complete.  Called by Int 16h when key becomes available
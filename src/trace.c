@@ -0,0 +1,117 @@
+// Binary trace events and a sampling profiler for runtime code.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "biosvar.h" // GET_LOW
+#include "util.h" // get_tsc
+#include "trace.h" // trace_event
+
+
+/****************************************************************
+ * Trace events
+ ****************************************************************/
+
+#define TRACE_SIGNATURE 0x52544253 // SBTR
+#define TRACE_EVENTS 64
+
+// Layout of the trace ring (decoded by tools/readtrace.py from a dump
+// of low memory).
+struct trace_event_s {
+    u64 tsc;
+    u32 id;
+    u32 args[4];
+};
+
+struct trace_ring_s {
+    u32 signature;
+    u32 size;           // Number of events in the ring
+    u32 head;           // Total events recorded
+    u32 khz;            // Frequency of the event timestamps
+    struct trace_event_s events[TRACE_EVENTS];
+};
+
+struct trace_ring_s TraceRing VARLOW = {
+    TRACE_SIGNATURE, TRACE_EVENTS
+};
+
+void
+__trace_event(u32 id, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+    // Claim a slot (the event may itself be interrupted by a traced irq)
+    u32 flags = save_flags();
+    irq_disable();
+    u32 head = GET_LOW(TraceRing.head);
+    SET_LOW(TraceRing.head, head + 1);
+    restore_flags(flags);
+
+    // Events come from both 16bit and 32bit code, so use a time source
+    // that is the same in every mode.
+    if (!GET_LOW(TraceRing.khz))
+        SET_LOW(TraceRing.khz, get_tsc_anymode_khz());
+    struct trace_event_s *e = &TraceRing.events[head % TRACE_EVENTS];
+    SET_LOW(e->tsc, get_tsc_anymode());
+    SET_LOW(e->id, id);
+    SET_LOW(e->args[0], a0);
+    SET_LOW(e->args[1], a1);
+    SET_LOW(e->args[2], a2);
+    SET_LOW(e->args[3], a3);
+}
+
+
+/****************************************************************
+ * Sampling profiler
+ ****************************************************************/
+
+#define PROFILE_SIGNATURE 0x52504253 // SBPR
+#define PROFILE_SHIFT 6
+#define PROFILE_BUCKETS (0x10000 >> PROFILE_SHIFT)
+
+// Histogram of interrupted code addresses (decoded by
+// tools/readprofile.py from a dump of low memory).
+struct profile_s {
+    u32 signature;
+    u16 shift;          // Log2 of the bytes covered by each bucket
+    u16 buckets;
+    u32 samples;        // Total samples
+    u32 segments[16];   // Samples by code segment (cs >> 12)
+    u16 hits[PROFILE_BUCKETS]; // Samples in the bios (cs == SEG_BIOS)
+};
+
+struct profile_s Profile VARLOW = {
+    PROFILE_SIGNATURE, PROFILE_SHIFT, PROFILE_BUCKETS
+};
+
+// Record the code address interrupted by the current irq.  Must be
+// called from an irq handler entered via irqentry_extrastack.
+void
+__profile_sample(void)
+{
+    // The irq entry code saves the interrupted %ss:%esp at the top of
+    // the extra stack (the same layout as stack_hop).
+    u8 *pos = GET_LOW(StackPos);
+    u16 ss = GET_FARVAR(SEG_LOW, *(u16*)(pos - 4));
+    u16 sp = GET_FARVAR(SEG_LOW, *(u16*)(pos - 8));
+    u16 ip = GET_FARVAR(ss, *(u16*)(sp + 0));
+    u16 cs = GET_FARVAR(ss, *(u16*)(sp + 2));
+
+    SET_LOW(Profile.samples, GET_LOW(Profile.samples) + 1);
+    int seg = cs >> 12;
+    SET_LOW(Profile.segments[seg], GET_LOW(Profile.segments[seg]) + 1);
+    if (cs != SEG_BIOS)
+        return;
+    int bucket = ip >> PROFILE_SHIFT;
+    u16 count = GET_LOW(Profile.hits[bucket]);
+    if (count != 0xffff)
+        SET_LOW(Profile.hits[bucket], count + 1);
+}
+
+// Start the rtc periodic irq (if configured) so samples are taken at
+// 1024Hz instead of on each timer tick.
+void
+profile_prepboot(void)
+{
+    if (!CONFIG_DEBUG_PROFILE_RTC)
+        return;
+    dprintf(1, "Enabling rtc irq for profiling\n");
+    useRTC();
+}
@@ -0,0 +1,37 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "types.h" // u32
+#include "config.h" // CONFIG_DEBUG_TRACE
+
+// Trace event ids.  The comment after each id names its arguments
+// (tools/readtrace.py uses it to decode the trace ring).
+#define TRACE_TIMER_TICK        0x01 // counter
+#define TRACE_DISK_OP           0x02 // drive, command, lba, count
+#define TRACE_DISK_DONE         0x03 // status, count
+#define TRACE_USB_KEY           0x04 // modifiers, key0, key1, key2
+#define TRACE_USB_MOUSE         0x05 // buttons, x, y
+
+// trace.c
+void __trace_event(u32 id, u32 a0, u32 a1, u32 a2, u32 a3);
+void __profile_sample(void);
+void profile_prepboot(void);
+
+// Record an event in the trace ring.  Only 16bit code is traced (the
+// hot paths are all there and the time source is the same for them).
+static inline void
+trace_event(u32 id, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+    if (CONFIG_DEBUG_TRACE && MODE16)
+        __trace_event(id, a0, a1, a2, a3);
+}
+
+// Record the code address interrupted by a timer irq.
+static inline void
+profile_sample(void)
+{
+    if (CONFIG_DEBUG_PROFILE && MODE16)
+        __profile_sample();
+}
+
+#endif // trace.h
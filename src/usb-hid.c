@@ -10,6 +10,7 @@
 #include "usb.h" // usb_ctrlrequest
 #include "biosvar.h" // GET_GLOBAL
 #include "ps2port.h" // ATKBD_CMD_GETID
+#include "trace.h" // trace_event
 
 struct usb_pipe *keyboard_pipe VARFSEG;
 struct usb_pipe *mouse_pipe VARFSEG;
@@ -302,6 +303,8 @@ usb_check_key(void)
         int ret = usb_poll_intr(pipe, &data);
         if (ret)
             break;
+        trace_event(TRACE_USB_KEY, data.modifiers, data.keys[0]
+                    , data.keys[1], data.keys[2]);
         handle_key(&data);
     }
 }
@@ -374,6 +377,7 @@ usb_check_mouse(void)
         int ret = usb_poll_intr(pipe, &data);
         if (ret)
             break;
+        trace_event(TRACE_USB_MOUSE, data.buttons, data.x, data.y, 0);
         handle_mouse(&data);
     }
 }
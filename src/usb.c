@@ -5,7 +5,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "util.h" // dprintf
-#include "pci.h" // foreachpci
+#include "pci.h" // foreachpci_class
 #include "config.h" // CONFIG_*
 #include "pci_regs.h" // PCI_CLASS_REVISION
 #include "pci_ids.h" // PCI_CLASS_SERIAL_USB_UHCI
@@ -18,6 +18,7 @@
 #include "usb-uas.h" // usb_uas_setup
 #include "usb.h" // struct usb_s
 #include "biosvar.h" // GET_GLOBAL
+#include "boot.h" // boot_skip_pci
 
 
 /****************************************************************
@@ -312,6 +313,10 @@ configure_usb_device(struct usbdevice_s *usbdev)
         && iface->bInterfaceClass != USB_CLASS_HUB)
         // Not a supported device.
         goto fail;
+    if (iface->bInterfaceClass == USB_CLASS_MASS_STORAGE
+        && boot_skip_pci(usbdev->hub->cntl->pci))
+        // Fast boot - no bootorder entry refers to this controller.
+        goto fail;
 
     // Set the configuration.
     ret = set_configuration(usbdev->defpipe, config->bConfigurationValue);
@@ -423,7 +428,7 @@ usb_setup(void)
     // Look for USB controllers
     int count = 0;
     struct pci_device *pci, *ehcipci = NULL;
-    foreachpci(pci) {
+    foreachpci_class(pci, PCI_CLASS_SERIAL_USB) {
         if (pci->class != PCI_CLASS_SERIAL_USB)
             continue;
 
@@ -54,6 +54,7 @@ static inline void wbinvd(void)
 #define CPUID_MSR (1 << 5)
 #define CPUID_APIC (1 << 9)
 #define CPUID_MTRR (1 << 12)
+#define CPUID_EXT_X2APIC (1 << 21)
 static inline void __cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
 {
     asm("cpuid"
@@ -189,9 +190,16 @@ inline void __call16_int(struct bregs *callregs, u16 offset);
 extern struct thread_info MainThread;
 struct thread_info *getCurThread(void);
 void yield(void);
+void yield_until(u64 end);
 void yield_toirq(void);
+void run_thread_stack(void (*func)(void*), void *data, u32 stacksize);
 void run_thread(void (*func)(void*), void *data);
+void thread_prepboot(void);
 void wait_threads(void);
+void wait_threads_until(int *done);
+int thread_cancelled(void);
+void thread_nocancel(void);
+int cancel_threads(void);
 struct mutex_s { u32 isLocked; };
 void mutex_lock(struct mutex_s *mutex);
 void mutex_unlock(struct mutex_s *mutex);
@@ -203,6 +211,9 @@ void check_preempt(void);
 // output.c
 extern u16 DebugOutputPort;
 void debug_serial_preinit(void);
+void firmware_log_attach(void *log);
+void firmware_log_setup(void);
+void firmware_log_prepboot(void);
 void panic(const char *fmt, ...)
     __attribute__ ((format (printf, 1, 2))) __noreturn;
 void printf(const char *fmt, ...)
@@ -278,6 +289,12 @@ void lpt_setup(void);
 #define PIT_TICK_RATE 1193180   // Underlying HZ of PIT
 #define PIT_TICK_INTERVAL 65536 // Default interval for 18.2Hz timer
 void pmtimer_setup(u16 ioport, u32 khz);
+void hpet_setup(void);
+u32 get_tsc_khz(void);
+u32 get_tsc_anymode_khz(void);
+u64 get_tsc_anymode(void);
+u64 get_tsc(void);
+int __check_tsc(u64 end);
 int check_tsc(u64 end);
 void timer_setup(void);
 void ndelay(u32 count);
@@ -288,6 +305,7 @@ void usleep(u32 count);
 void msleep(u32 count);
 u64 calc_future_tsc(u32 msecs);
 u64 calc_future_tsc_usec(u32 usecs);
+u32 tsc_to_usec(u64 ticks);
 u32 calc_future_timer_ticks(u32 count);
 u32 calc_future_timer(u32 msecs);
 int check_timer(u32 end);
@@ -320,9 +338,19 @@ void smm_setup(void);
 // smp.c
 extern u32 CountCPUs;
 extern u32 MaxCountCPUs;
+extern u32 MaxAPICID;
 void wrmsr_smp(u32 index, u64 val);
 void smp_setup(void);
-int apic_id_is_present(u8 apic_id);
+int apic_id_is_present(u32 apic_id);
+struct smp_job_s {
+    void (*func)(void *data);
+    void *data;
+    u32 done;
+};
+void smp_job_submit(struct smp_job_s *job);
+void smp_job_wait(struct smp_job_s *job);
+void smp_memset(void *s, int c, size_t n);
+void smp_dispatch_finish(void);
 
 // coreboot.c
 extern const char *CBvendor, *CBpart;
@@ -332,6 +360,7 @@ void coreboot_platform_setup(void);
 void cbfs_payload_setup(void);
 void coreboot_preinit(void);
 void coreboot_cbfs_init(void);
+void coreboot_export_console(void *console);
 
 // biostable.c
 void copy_smbios(void *pos);
@@ -346,12 +375,27 @@ void vgahook_setup(struct pci_device *pci);
 void call_bcv(u16 seg, u16 ip);
 int is_pci_vga(struct pci_device *pci);
 void optionrom_setup(void);
+int optionrom_is_deferred(u16 seg);
+void optionrom_run_deferred(u16 seg);
 void vgarom_setup(void);
 void s3_resume_vga(void);
 extern int ScreenAndDebug;
+extern void *RomCache;
+
+// bootprof.c
+void bootprof_init(void);
+int bootprof_begin(const char *name, void *func);
+void bootprof_end(int id);
+void bootprof_report(void);
+#define BOOTPROF(func) do {                             \
+        int __bpid = bootprof_begin(#func, NULL);       \
+        func();                                         \
+        bootprof_end(__bpid);                           \
+    } while (0)
 
 // bootsplash.c
 void enable_vga_console(void);
+void preload_bootsplash(void);
 void enable_bootsplash(void);
 void disable_bootsplash(void);
 
@@ -378,6 +422,7 @@ void malloc_init(void);
 void malloc_prepboot(void);
 void *pmm_malloc(struct zone_s *zone, u32 handle, u32 size, u32 align);
 int pmm_free(void *data);
+void *malloc_arena(u32 size);
 void pmm_init(void);
 void pmm_prepboot(void);
 #define PMM_DEFAULT_HANDLE 0xFFFFFFFF
@@ -441,6 +486,8 @@ void romfile_add(struct romfile_s *file);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
 void *romfile_loadfile(const char *name, int *psize);
+struct romfile_preload_s *romfile_preload(struct romfile_s *file);
+void *romfile_preload_finish(struct romfile_preload_s *preload, int *psize);
 u64 romfile_loadint(const char *name, u64 defval);
 
 // romlayout.S
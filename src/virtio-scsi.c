@@ -8,7 +8,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "util.h" // dprintf
-#include "pci.h" // foreachpci
+#include "pci.h" // foreachpci_id
 #include "config.h" // CONFIG_*
 #include "biosvar.h" // GET_GLOBAL
 #include "pci_ids.h" // PCI_DEVICE_ID_VIRTIO_BLK
@@ -173,10 +173,13 @@ virtio_scsi_setup(void)
     dprintf(3, "init virtio-scsi\n");
 
     struct pci_device *pci;
-    foreachpci(pci) {
+    foreachpci_id(pci, PCI_VENDOR_ID_REDHAT_QUMRANET
+                  , PCI_DEVICE_ID_VIRTIO_SCSI) {
         if (pci->vendor != PCI_VENDOR_ID_REDHAT_QUMRANET
             || pci->device != PCI_DEVICE_ID_VIRTIO_SCSI)
             continue;
+        if (boot_skip_pci(pci))
+            continue;
         init_virtio_scsi(pci);
     }
 }
@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+# Script that maps the sampling profiler histogram to bios functions.
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   tools/readprofile.py memdump.bin out/romlayout16.lds
+#
+# The dump should contain the bios area (0xc0000-0xfffff) - for
+# example, from the qemu monitor "pmemsave 0 0x100000 memdump.bin".
+# The linker script is the one generated by tools/layoutrom.py for the
+# same build of the bios.
+
+import sys
+import re
+import struct
+import optparse
+
+SIGNATURE = b"SBPR"
+HEADER = struct.Struct("<4sHHI16I")
+
+SEGNAMES = {0xc: "option roms (c000)", 0xd: "option roms (d000)",
+            0xe: "bios (e000)", 0xf: "bios (f000)"}
+
+# Read the position of each 16bit section from the layoutrom output.
+def parselayout(filename):
+    posre = re.compile(r"^\. = \( 0x([0-9a-f]+) - code16_start \) ;$")
+    secre = re.compile(r"^\*\((\S+)\)$")
+    sections = []
+    pos = None
+    for line in open(filename):
+        line = line.strip()
+        m = posre.match(line)
+        if m is not None:
+            pos = int(m.group(1), 16)
+            continue
+        m = secre.match(line)
+        if m is not None and pos is not None:
+            name = m.group(1)
+            if name.startswith(".text."):
+                name = name[6:]
+            sections.append((pos, name))
+            pos = None
+    sections.sort()
+    return sections
+
+# Find the histogram in the memory dump (the rom image contains an
+# unused copy too, so pick the one with the most samples).
+def findprofile(data):
+    best = None
+    pos = data.find(SIGNATURE)
+    while pos >= 0:
+        if pos % 4 == 0 and pos + HEADER.size <= len(data):
+            fields = HEADER.unpack_from(data, pos)
+            shift, buckets, samples = fields[1:4]
+            end = pos + HEADER.size + buckets * 2
+            if buckets and buckets << shift == 0x10000 and end <= len(data):
+                if best is None or samples > best[3]:
+                    best = (pos, shift, buckets, samples, fields[4:])
+        pos = data.find(SIGNATURE, pos + 1)
+    return best
+
+# Spread the samples of each bucket over the sections it overlaps.
+def mapbuckets(hits, shift, sections):
+    funcs = {}
+    ends = [s[0] for s in sections[1:]] + [0x10000]
+    for i, count in enumerate(hits):
+        if not count:
+            continue
+        start = i << shift
+        end = start + (1 << shift)
+        overlap = []
+        for (secpos, name), secend in zip(sections, ends):
+            lo, hi = max(start, secpos), min(end, secend)
+            if lo < hi:
+                overlap.append((name, hi - lo))
+        if not overlap:
+            overlap = [("unknown@0x%04x" % (start,), 1 << shift)]
+        total = sum(size for name, size in overlap)
+        for name, size in overlap:
+            funcs[name] = funcs.get(name, 0.0) + float(count) * size / total
+    return funcs
+
+def main():
+    usage = "%prog [options] <memdump> <romlayout16.lds>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=30,
+                    help="number of functions to show")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    data = open(args[0], "rb").read()
+    sections = parselayout(args[1])
+
+    prof = findprofile(data)
+    if prof is None:
+        sys.stderr.write("Unable to find profile histogram\n")
+        sys.exit(1)
+    pos, shift, buckets, samples, segments = prof
+    hits = struct.unpack_from("<%dH" % (buckets,), data, pos + HEADER.size)
+    sys.stdout.write("Profile at 0x%x: %d samples\n" % (pos, samples))
+    if not samples:
+        return
+
+    sys.stdout.write("\nSamples by code segment:\n")
+    for seg, count in enumerate(segments):
+        if count:
+            name = SEGNAMES.get(seg, "other")
+            sys.stdout.write("  %x000 %8d %5.1f%%  %s\n" % (
+                seg, count, 100.0 * count / samples, name))
+
+    funcs = mapbuckets(hits, shift, sections)
+    order = sorted(funcs.items(), key=lambda f: f[1], reverse=True)
+    sys.stdout.write("\nBios functions (%d byte resolution):\n" % (
+        1 << shift,))
+    for name, count in order[:options.count]:
+        sys.stdout.write("  %10.1f %5.1f%%  %s\n" % (
+            count, 100.0 * count / samples, name))
+
+if __name__ == '__main__':
+    main()
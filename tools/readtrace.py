@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+# Script that decodes the binary trace ring from a dump of low memory.
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   tools/readtrace.py memdump.bin
+#
+# The dump should contain the bios area (0xc0000-0xfffff) - for
+# example, from the qemu monitor "pmemsave 0 0x100000 memdump.bin".
+
+import sys
+import os
+import re
+import struct
+import optparse
+
+SIGNATURE = b"SBTR"
+HEADER = struct.Struct("<4sIII")
+EVENT = struct.Struct("<QIIIII")
+MAXEVENTS = 4096
+
+# Read the event names and argument names from src/trace.h
+def parseheader(filename):
+    events = {}
+    pattern = re.compile(r"^#define\s+TRACE_(\w+)\s+(0x[0-9a-fA-F]+|\d+)"
+                         r"\s*(?://\s*(.*))?$")
+    for line in open(filename):
+        m = pattern.match(line.strip())
+        if m is None:
+            continue
+        name, id, args = m.groups()
+        args = [a.strip() for a in (args or "").split(",") if a.strip()]
+        events[int(id, 0)] = (name.lower(), args)
+    return events
+
+# Find the trace ring in the memory dump (the rom image contains an
+# unused copy of the ring too, so pick the one with the most events).
+def findring(data):
+    best = None
+    pos = data.find(SIGNATURE)
+    while pos >= 0:
+        if pos % 4 == 0 and pos + HEADER.size <= len(data):
+            sig, size, head, khz = HEADER.unpack_from(data, pos)
+            end = pos + HEADER.size + size * EVENT.size
+            if size and size <= MAXEVENTS and end <= len(data):
+                if best is None or head > best[2]:
+                    best = (pos, size, head, khz)
+        pos = data.find(SIGNATURE, pos + 1)
+    return best
+
+def decode(data, base, events, outfile):
+    ring = findring(data)
+    if ring is None:
+        sys.stderr.write("Unable to find trace ring\n")
+        sys.exit(1)
+    pos, size, head, khz = ring
+    outfile.write("Trace ring at 0x%x: %d events (ring holds %d), %d kHz\n" % (
+        base + pos, head, size, khz))
+    first = max(0, head - size)
+    starttsc = None
+    for i in range(first, head):
+        offset = pos + HEADER.size + (i % size) * EVENT.size
+        tsc, id, a0, a1, a2, a3 = EVENT.unpack_from(data, offset)
+        if starttsc is None:
+            starttsc = tsc
+        if khz:
+            when = "%12.3fms" % (float(tsc - starttsc) / khz,)
+        else:
+            when = "%14d" % (tsc - starttsc,)
+        name, argnames = events.get(id, ("event%d" % (id,), []))
+        args = [a0, a1, a2, a3]
+        if argnames:
+            desc = ["%s=0x%x" % (n, v) for n, v in zip(argnames, args)]
+        else:
+            desc = ["0x%x" % (v,) for v in args]
+        outfile.write("%s %6d %-12s %s\n" % (when, i, name, " ".join(desc)))
+
+def main():
+    usage = "%prog [options] <memdump>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--base", type="string", dest="base", default="0",
+                    help="physical address of the start of the dump")
+    defheader = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                             "..", "src", "trace.h")
+    opts.add_option("--header", type="string", dest="header",
+                    default=defheader,
+                    help="location of trace.h (for event names)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    data = open(args[0], "rb").read()
+    events = parseheader(options.header)
+    decode(data, int(options.base, 0), events, sys.stdout)
+
+if __name__ == '__main__':
+    main()